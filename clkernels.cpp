@@ -26,10 +26,23 @@ const char* testDescsTable[] =
     nullptr
 };
 
+/* prepended to kernel source; with RUNTIME_ITERS kitersNum and blocksNum are
+ * passed as last kernel arguments (used while calibrating) */
+const char* clKernelItersSource =
+"#ifdef RUNTIME_ITERS\n"
+"#define ITERS_ARGS , uint kitersNum, uint blocksNum\n"
+"#define KITERSNUM kitersNum\n"
+"#define BLOCKSNUM blocksNum\n"
+"#else\n"
+"#define ITERS_ARGS\n"
+"#endif\n"
+"\n";
+
 const char* clKernel1Source =
 "#pragma OPENCL FP_CONTRACT OFF\n"
 "\n"
-"kernel void gpuStress(uint n, const global float4* input, global float4* output)\n"
+"kernel void gpuStress(uint n, const global float4* input, global float4* output\n"
+"            ITERS_ARGS)\n"
 "{\n"
 "    local float localData[GROUPSIZE];\n"
 "    size_t gid = get_global_id(0);\n"
@@ -86,14 +99,15 @@ const char* clKernel1Source =
 "        output[gid*4+2] = inValue3;\n"
 "        output[gid*4+3] = inValue4;\n"
 "        \n"
-"        gid += get_global_size(0);\n"
+"        gid += n;\n"
 "    }\n"
 "}\n";
 
 const char* clKernel2Source =
 "#pragma OPENCL FP_CONTRACT OFF\n"
 "\n"
-"kernel void gpuStress(uint n, const global float4* input, global float4* output)\n"
+"kernel void gpuStress(uint n, const global float4* input, global float4* output\n"
+"            ITERS_ARGS)\n"
 "{\n"
 "    size_t gid = get_global_id(0);\n"
 "    \n"
@@ -134,7 +148,7 @@ const char* clKernel2Source =
 "        output[gid*4+1] = inValue2;\n"
 "        output[gid*4+2] = inValue3;\n"
 "        output[gid*4+3] = inValue4;\n"
-"        gid += get_global_size(0);\n"
+"        gid += n;\n"
 "    }\n"
 "}\n";
 
@@ -147,7 +161,8 @@ const char* clKernelPWSource =
 "}\n"
 "\n"
 "kernel void gpuStress(uint n, const global float4* input,\n"
-"            global float4* output, float p0, float p1, float p2, float p3, float p4)\n"
+"            global float4* output, float p0, float p1, float p2, float p3, float p4\n"
+"            ITERS_ARGS)\n"
 "{\n"
 "    size_t gid = get_global_id(0);\n"
 "    \n"
@@ -170,7 +185,7 @@ const char* clKernelPWSource =
 "        output[gid*4+2] = x3;\n"
 "        output[gid*4+3] = x4;\n"
 "        \n"
-"        gid += get_global_size(0);\n"
+"        gid += n;\n"
 "    }\n"
 "}\n";
 
@@ -187,7 +202,8 @@ const char* clKernelPW2Source =
 "}\n"
 "\n"
 "kernel void gpuStress(uint n, const global float4* input,\n"
-"            global float4* output, float p0, float p1, float p2, float p3, float p4)\n"
+"            global float4* output, float p0, float p1, float p2, float p3, float p4\n"
+"            ITERS_ARGS)\n"
 "{\n"
 "    size_t gid = get_global_id(0);\n"
 "    size_t lid = get_local_id(0);\n"
@@ -224,7 +240,67 @@ const char* clKernelPW2Source =
 "        output[gid*4+2] = x3;\n"
 "        output[gid*4+3] = x4;\n"
 "        \n"
-"        gid += get_global_size(0);\n"
+"        gid += n;\n"
+"    }\n"
+"}\n";
+
+const char* clVerifyKernelSource =
+"static inline void reportMismatch(global uint* mismatches, uint maxIndices, uint index)\n"
+"{\n"
+"    const uint pos = atomic_inc(mismatches);\n"
+"    if (pos < maxIndices)\n"
+"        mismatches[pos+1] = index;\n"
+"}\n"
+"\n"
+"kernel void compareResults(uint n, const global uint4* golden, const global uint4* results,\n"
+"            global uint* mismatches, uint maxIndices)\n"
+"{\n"
+"    for (uint i = get_global_id(0); i < n; i += get_global_size(0))\n"
+"    {\n"
+"        const uint4 diff = golden[i] ^ results[i];\n"
+"        if ((diff.x|diff.y|diff.z|diff.w) == 0)\n"
+"            continue;\n"
+"        if (diff.x != 0)\n"
+"            reportMismatch(mismatches, maxIndices, i*4);\n"
+"        if (diff.y != 0)\n"
+"            reportMismatch(mismatches, maxIndices, i*4+1);\n"
+"        if (diff.z != 0)\n"
+"            reportMismatch(mismatches, maxIndices, i*4+2);\n"
+"        if (diff.w != 0)\n"
+"            reportMismatch(mismatches, maxIndices, i*4+3);\n"
 "    }\n"
 "}\n";
 
+const char* clDigestKernelSource =
+"static inline ulong combineDigests(ulong a, ulong b)\n"
+"{\n"
+"    return (a*0x9e3779b97f4a7c15UL) ^ (b + (a>>29) + 0x632be59bd9b4e019UL);\n"
+"}\n"
+"\n"
+"kernel void digestResults(uint n, const global uint4* results, global ulong* digests,\n"
+"            local ulong* localDigests)\n"
+"{\n"
+"    const uint lid = get_local_id(0);\n"
+"    const uint lsize = get_local_size(0);\n"
+"    ulong digest = 0xcbf29ce484222325UL ^ get_global_id(0);\n"
+"    /* FNV-1a over all words processed by this work-item */\n"
+"    for (uint i = get_global_id(0); i < n; i += get_global_size(0))\n"
+"    {\n"
+"        const uint4 v = results[i];\n"
+"        digest = (digest ^ v.x) * 0x100000001b3UL;\n"
+"        digest = (digest ^ v.y) * 0x100000001b3UL;\n"
+"        digest = (digest ^ v.z) * 0x100000001b3UL;\n"
+"        digest = (digest ^ v.w) * 0x100000001b3UL;\n"
+"    }\n"
+"    localDigests[lid] = digest;\n"
+"    barrier(CLK_LOCAL_MEM_FENCE);\n"
+"    /* reduce in fixed order, so digest of workgroup is deterministic */\n"
+"    for (uint s = 1; s < lsize; s <<= 1)\n"
+"    {\n"
+"        if ((lid & ((s<<1)-1)) == 0 && lid+s < lsize)\n"
+"            localDigests[lid] = combineDigests(localDigests[lid], localDigests[lid+s]);\n"
+"        barrier(CLK_LOCAL_MEM_FENCE);\n"
+"    }\n"
+"    if (lid == 0)\n"
+"        digests[get_group_id(0)] = localDigests[0];\n"
+"}\n";
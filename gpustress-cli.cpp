@@ -90,6 +90,76 @@ static const poptOption optionsTable[] =
     { "dontWait", 'w', POPT_ARG_VAL, &dontWait, 'w', "Dont wait few seconds", nullptr },
     { "exitIfAllFails", 'f', POPT_ARG_VAL, &exitIfAllFails, 'f',
         "Exit only when all devices will fail at computation", nullptr },
+    { "verifyMode", 'v', POPT_ARG_INT, &verificationMode, 'v',
+        "Choose verification mode (0 - on host, 1 - on device, 2 - by digests)",
+        "MODE" },
+    { "compareThreads", 0, POPT_ARG_INT, &compareThreadsNum, 0,
+        "Set number of threads comparing results on host (0 - all cores)", "THREADS" },
+    { "pipelineDepth", 0, POPT_ARG_INT, &pipelineDepth, 0,
+        "Set number of passes executed concurrently (1-8, default 2)", "DEPTH" },
+    { "asyncEngine", 0, POPT_ARG_VAL, &useAsyncEngine, 1,
+        "Drive all devices from single thread by using event callbacks", nullptr },
+    { "outOfOrder", 0, POPT_ARG_VAL, &useOutOfOrderQueues, 1,
+        "Use out-of-order command queues if device supports them", nullptr },
+    { "kernelCache", 0, POPT_ARG_STRING, &programCacheDir, 0,
+        "Cache compiled kernel binaries in directory", "DIR" },
+    { "sharePrograms", 0, POPT_ARG_VAL, &useSharedPrograms, 1,
+        "Share context and kernel programs between identical devices", nullptr },
+    { "calibMode", 0, POPT_ARG_INT, &calibrationMode, 0,
+        "Choose calibration mode (0 - probe all kitersNums, 1 - search)", "MODE" },
+    { "calibBudget", 0, POPT_ARG_INT, &calibrationBudget, 0,
+        "Set time budget for calibration of device (0 - unlimited)", "SECONDS" },
+    { "calibTolerance", 0, POPT_ARG_INT, &calibrationTolerance, 0,
+        "Set kitersNum step at which calibration search stops (1-8)", "STEP" },
+    { "autotune", 0, POPT_ARG_INT, &autotuneBudget, 0,
+        "Autotune groupSize, workFactor, blocksNum and kitersNum for given time",
+        "SECONDS" },
+    { "autotuneObjective", 0, POPT_ARG_INT, &autotuneObjective, 0,
+        "Set autotune objective (0 - GFLOPS, 1 - bandwidth, 2 - product, "
+        "3 - kernel time under cap)", "OBJECTIVE" },
+    { "autotuneTimeCap", 0, POPT_ARG_INT, &autotuneTimeCap, 0,
+        "Set maximal kernel time accepted by autotuning", "MILLIS" },
+    { "calibProfiles", 0, POPT_ARG_STRING, &calibrationProfilesFile, 0,
+        "Load and store calibration results in given file", "FILE" },
+    { "calibRevalidate", 0, POPT_ARG_VAL, &calibrationRevalidate, 1,
+        "Check loaded calibration profile by single kernel probe", nullptr },
+    { "timingWarmup", 0, POPT_ARG_INT, &timingWarmup, 0,
+        "Set number of kernel runs before timing (0-100)", "RUNS" },
+    { "timingSamples", 0, POPT_ARG_INT, &timingSamples, 0,
+        "Set (maximal) number of kernel timing samples (1-1000)", "SAMPLES" },
+    { "timingEstimator", 0, POPT_ARG_INT, &timingEstimator, 0,
+        "Set kernel time estimator (0 - median, 1 - trimmed mean)", "ESTIMATOR" },
+    { "timingConfidence", 0, POPT_ARG_INT, &timingConfidence, 0,
+        "Stop sampling when 95% confidence interval is within given percent",
+        "PERCENT" },
+    { "sampleKernels", 0, POPT_ARG_INT, &kernelSamplingPeriod, 0,
+        "Measure device time of every N-th kernel during test", "N" },
+    { "metricsFile", 0, POPT_ARG_STRING, &metricsFile, 0,
+        "Write calibration, pass, failure and exit records to file", "FILE" },
+    { "metricsFormat", 0, POPT_ARG_INT, &metricsFormat, 0,
+        "Set metrics format (0 - JSON Lines, 1 - CSV)", "FORMAT" },
+    { "metricsPort", 0, POPT_ARG_INT, &metricsServerPort, 0,
+        "Serve live metrics over HTTP on localhost port", "PORT" },
+    { "metricsSocket", 0, POPT_ARG_STRING, &metricsServerSocket, 0,
+        "Serve live metrics over HTTP on Unix socket", "PATH" },
+    { "driftThreshold", 0, POPT_ARG_INT, &driftThreshold, 0,
+        "Warn when throughput drops by given percent (1-99)", "PERCENT" },
+    { "driftSigma", 0, POPT_ARG_INT, &driftSigma, 0,
+        "Warn when pass time exceeds average by given number of sigmas", "SIGMAS" },
+    { "traceFile", 0, POPT_ARG_STRING, &traceFile, 0,
+        "Write timeline of commands in Chrome trace event format", "FILE" },
+    { "traceEvents", 0, POPT_ARG_INT, &traceBufferSize, 0,
+        "Set number of last trace events kept for every device", "EVENTS" },
+    { "asyncLog", 0, POPT_ARG_VAL, &useAsyncLogger, 1,
+        "Write output of testers by background thread in batches", nullptr },
+    { "logDir", 0, POPT_ARG_STRING, &logDirectory, 0,
+        "Write output of every device with timestamps to log file in directory", "DIR" },
+    { "maxQueuedTime", 0, POPT_ARG_INT, &maxQueuedTime, 0,
+        "Set maximum time of queued kernels in milliseconds (0 - fixed queue depth)", "MILLIS" },
+    { "stopLatency", 0, POPT_ARG_INT, &stopLatency, 0,
+        "Set time limit for stopping test in milliseconds", "MILLIS" },
+    { "kernelTimeSlice", 0, POPT_ARG_INT, &kernelTimeSlice, 0,
+        "Split longer kernels into launches shorter than given milliseconds", "MILLIS" },
     { "version", 'V', POPT_ARG_VAL, &printVersion, 'V', "Print program version", nullptr },
     { "help", '?', POPT_ARG_VAL, &printHelp, '?', "Show this help message", nullptr },
     { "usage", 0, POPT_ARG_VAL, &printUsage, 'u', "Display brief usage message", nullptr },
@@ -170,8 +240,8 @@ static void listChoosenCLDevices(const std::vector<cl::Device>& list)
 static BOOL WINAPI handleCtrlInterrupt(DWORD ctrlType)
 {
     if (ctrlType == CTRL_C_EVENT)
-    {
-        stopAllStressTestersByUser.store(true);
+    {   // handler is called in separate thread
+        stopAllStressTesters(true);
         SetConsoleCtrlHandler(handleCtrlInterrupt, FALSE);
         return TRUE;
     }
@@ -198,6 +268,7 @@ static bool signalHandlerInstalled = false;
 
 static void handleInterrupt(int signo)
 {
+    recordStopRequest();
     stopAllStressTestersByUser.store(true);
 }
 
@@ -346,6 +417,8 @@ int main(int argc, const char** argv)
     std::vector<GPUStressConfig> gpuStressConfigs;
     std::vector<GPUStressTester*> gpuStressTesters;
     std::vector<std::thread*> testerThreads;
+    GPUStressMetricsServer metricsServer;
+    GPUStressLogger logger;
     try
     {
         std::vector<cl::Device> choosenCLDevices;
@@ -384,6 +457,8 @@ int main(int argc, const char** argv)
             gpuStressConfigs = collectGPUStressConfigs(choosenCLDevices.size(),
                     passItersNums, groupSizes, workFactors, blocksNums, kitersNums,
                     builtinKernels, inputAndOutputs);
+            checkGPUStressOptions();
+            openMetricsFile();
         }
         
         std::cout <<
@@ -427,19 +502,10 @@ int main(int argc, const char** argv)
             {
                 try
                 {
-                    for (size_t i = 0; i < choosenCLDevices.size(); i++)
-                    {
-                        cl::Device& clDevice = choosenCLDevices[i];
-                        GPUStressTester* stressTester = new GPUStressTester(i, clDevice,
-                                    gpuStressConfigs[i]);
-                        if (!stressTester->isInitialized())
-                        {
-                            ifExitingAtInit = true;
-                            delete stressTester;
-                            break;
-                        }
-                        gpuStressTesters.push_back(stressTester);
-                    }
+                    gpuStressTesters = createGPUStressTesters(choosenCLDevices,
+                                gpuStressConfigs);
+                    if (gpuStressTesters.empty())
+                        ifExitingAtInit = true;
                 }
                 catch(const cl::Error& error)
                 {
@@ -464,9 +530,20 @@ int main(int argc, const char** argv)
             preparingThread.join();
         }
         if (!ifExitingAtInit && retVal==0)
-            for (size_t i = 0; i < choosenCLDevices.size(); i++)
-                testerThreads.push_back(new std::thread(
-                        &GPUStressTester::runTest, gpuStressTesters[i]));
+        {
+            metricsServer.start(gpuStressTesters);
+            logger.start(gpuStressTesters);
+            if (useAsyncEngine)
+                testerThreads.push_back(new std::thread([&gpuStressTesters]()
+                {
+                    GPUStressReactor reactor;
+                    reactor.run(gpuStressTesters);
+                }));
+            else
+                for (size_t i = 0; i < choosenCLDevices.size(); i++)
+                    testerThreads.push_back(new std::thread(
+                            &GPUStressTester::runTest, gpuStressTesters[i]));
+        }
     }
     catch(const cl::Error& error)
     {
@@ -503,13 +580,17 @@ int main(int argc, const char** argv)
                 }
                 delete testerThreads[i];
                 testerThreads[i] = nullptr;
-                if (gpuStressTesters.size() > i &&
-                    gpuStressTesters[i] != nullptr && !gpuStressTesters[i]->isFailed())
-                {
-                    std::lock_guard<std::mutex> l(stdOutputMutex);
-                    *outStream << "Finished #" << i << std::endl;
-                }
             }
+        logger.stop();
+        metricsServer.stop();
+        try
+        { writeTraceFile(gpuStressTesters); }
+        catch(const std::exception& ex)
+        {   // testers must be deleted and reported anyway
+            std::lock_guard<std::mutex> l(stdOutputMutex);
+            *errStream << "Exception happened: " << ex.what() << std::endl;
+            retVal = 1;
+        }
         
         for (size_t i = 0; i < gpuStressTesters.size(); i++)
         {
@@ -519,6 +600,11 @@ int main(int argc, const char** argv)
                 std::lock_guard<std::mutex> l(stdOutputMutex);
                 *errStream << "Failed #" << i << std::endl;
             }
+            else if (!testerThreads.empty())
+            {
+                std::lock_guard<std::mutex> l(stdOutputMutex);
+                *outStream << "Finished #" << i << std::endl;
+            }
             delete gpuStressTesters[i];
         }
     }
@@ -28,10 +28,29 @@
 #include <cstring>
 #include <utility>
 #include <set>
+#include <tuple>
 #include <cmath>
-#ifdef _WINDOWS
 #include <thread>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <climits>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2_COMPARE 1
+#endif
+#ifdef _WINDOWS
 #include <windows.h>
+#else
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #endif
 #include "gpustress-core.h"
 
@@ -347,12 +366,98 @@ std::vector<GPUStressConfig> collectGPUStressConfigs(cxuint devicesNum,
     return outConfigs;
 }
 
+void checkGPUStressOptions()
+{
+    if (verificationMode < VERIFY_HOST_COMPARE || verificationMode > VERIFY_DIGEST)
+        throw MyException("VerifyMode out of range");
+    if (compareThreadsNum < 0)
+        throw MyException("CompareThreads is negative");
+    if (pipelineDepth < 1 || pipelineDepth > 8)
+        throw MyException("PipelineDepth out of range");
+    if (calibrationMode < CALIBRATE_SWEEP || calibrationMode > CALIBRATE_SEARCH)
+        throw MyException("CalibrationMode out of range");
+    if (calibrationBudget < 0)
+        throw MyException("CalibrationBudget is negative");
+    if (calibrationTolerance < 1 || calibrationTolerance > 8)
+        throw MyException("CalibrationTolerance out of range");
+    if (autotuneBudget < 0)
+        throw MyException("AutotuneBudget is negative");
+    if (autotuneObjective < AUTOTUNE_PERF || autotuneObjective > AUTOTUNE_KERNEL_TIME)
+        throw MyException("AutotuneObjective out of range");
+    if (autotuneTimeCap < 0)
+        throw MyException("AutotuneTimeCap is negative");
+    if (autotuneObjective == AUTOTUNE_KERNEL_TIME && autotuneTimeCap == 0)
+        throw MyException("AutotuneTimeCap must be set for kernel time objective");
+    if (timingWarmup < 0 || timingWarmup > 100)
+        throw MyException("TimingWarmup out of range");
+    if (timingSamples < 1 || timingSamples > 1000)
+        throw MyException("TimingSamples out of range");
+    if (timingEstimator < TIMING_MEDIAN || timingEstimator > TIMING_TRIMMED_MEAN)
+        throw MyException("TimingEstimator out of range");
+    if (timingConfidence < 0 || timingConfidence > 100)
+        throw MyException("TimingConfidence out of range");
+    if (kernelSamplingPeriod < 0)
+        throw MyException("KernelSamplingPeriod is negative");
+    if (metricsFormat < METRICS_JSON_LINES || metricsFormat > METRICS_CSV)
+        throw MyException("MetricsFormat out of range");
+    if (metricsServerPort < 0 || metricsServerPort > 65535)
+        throw MyException("MetricsServerPort out of range");
+    if (driftThreshold < 0 || driftThreshold > 99)
+        throw MyException("DriftThreshold out of range");
+    if (driftSigma < 0)
+        throw MyException("DriftSigma is negative");
+    if (traceBufferSize < 1)
+        throw MyException("TraceBufferSize out of range");
+    if (maxQueuedTime < 0 || maxQueuedTime > 60000)
+        throw MyException("MaxQueuedTime out of range");
+    if (stopLatency < 0 || stopLatency > 60000)
+        throw MyException("StopLatency out of range");
+    if (kernelTimeSlice < 0 || kernelTimeSlice > 60000)
+        throw MyException("KernelTimeSlice out of range");
+}
+
+extern const char* clKernelItersSource;
 extern const char* clKernel1Source;
 extern const char* clKernel2Source;
 extern const char* clKernelPWSource;
 extern const char* clKernelPW2Source;
+extern const char* clVerifyKernelSource;
+extern const char* clDigestKernelSource;
 
 int exitIfAllFails = 0;
+int verificationMode = VERIFY_HOST_COMPARE;
+int compareThreadsNum = 0;
+int pipelineDepth = 2;
+int useAsyncEngine = 0;
+int useOutOfOrderQueues = 0;
+const char* programCacheDir = nullptr;
+int useSharedPrograms = 0;
+int calibrationMode = CALIBRATE_SWEEP;
+int calibrationBudget = 0;
+int calibrationTolerance = 1;
+int autotuneBudget = 0;
+int autotuneObjective = AUTOTUNE_PRODUCT;
+int autotuneTimeCap = 0;
+const char* calibrationProfilesFile = nullptr;
+int calibrationRevalidate = 0;
+int timingWarmup = 1;
+int timingSamples = 5;
+int timingEstimator = TIMING_MEDIAN;
+int timingConfidence = 0;
+int kernelSamplingPeriod = 0;
+const char* metricsFile = nullptr;
+int metricsFormat = METRICS_JSON_LINES;
+int metricsServerPort = 0;
+const char* metricsServerSocket = nullptr;
+int driftThreshold = 0;
+int driftSigma = 0;
+const char* traceFile = nullptr;
+int traceBufferSize = 65536;
+int useAsyncLogger = 0;
+const char* logDirectory = nullptr;
+int maxQueuedTime = 0;
+int stopLatency = 0;
+int kernelTimeSlice = 0;
 
 std::mutex stdOutputMutex;
 std::ostream* outStream = nullptr;
@@ -361,6 +466,53 @@ std::ostream* errStream = nullptr;
 std::atomic<bool> stopAllStressTestersIfFail(false);
 std::atomic<bool> stopAllStressTestersByUser(false);
 
+// steady clock time of first stop request in nanoseconds (0 - not requested)
+static std::atomic<int64_t> stopRequestTime(0);
+// testers which can wait for events
+static std::mutex stopWaitersMutex;
+static std::set<GPUStressTester*> stopWaiters;
+
+static int64_t getSteadyNanos()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                SteadyClock::now().time_since_epoch()).count();
+}
+
+void recordStopRequest()
+{
+    int64_t expected = 0;
+    stopRequestTime.compare_exchange_strong(expected, getSteadyNanos());
+}
+
+void stopAllStressTesters(bool byUser)
+{
+    recordStopRequest();
+    if (byUser)
+        stopAllStressTestersByUser.store(true);
+    else
+        stopAllStressTestersIfFail.store(true);
+    std::lock_guard<std::mutex> l(stopWaitersMutex);
+    for (GPUStressTester* tester: stopWaiters)
+        tester->wakeUp();
+}
+
+void clearStopRequest()
+{
+    stopAllStressTestersIfFail.store(false);
+    stopAllStressTestersByUser.store(false);
+    stopRequestTime.store(0);
+}
+
+/* maximal time of queued kernels in nanoseconds (0 - fixed queue depth),
+ * half of stop latency limit leaves time for end of pass and for readback */
+static double getMaxQueuedNanos()
+{
+    double nanos = double(maxQueuedTime)*1e6;
+    if (stopLatency != 0 && (nanos == 0.0 || nanos > double(stopLatency)*0.5e6))
+        nanos = double(stopLatency)*0.5e6;
+    return nanos;
+}
+
 OutputHandler outputHandler = nullptr;
 void* outputHandlerData = nullptr;
 
@@ -373,20 +525,547 @@ void installOutputHandler(std::ostream* out, std::ostream* err,
     outputHandlerData = data;
 }
 
+/*
+ * metrics sink
+ */
+
+static std::mutex metricsMutex;
+static std::ostream* metricsStream = nullptr;
+static int metricsStreamFormat = METRICS_JSON_LINES;
+static std::ofstream metricsFileStream;
+// pass records are flushed at most once per this period, other records at once
+static const std::chrono::milliseconds metricsFlushPeriod(1000);
+static SteadyClock::time_point metricsLastFlushTime;
+
+static const char* metricsRecordTypeNames[5] =
+{ "calibration", "pass", "failure", "exit", "warning" };
+
+void installMetricsSink(std::ostream* stream, int format)
+{
+    std::lock_guard<std::mutex> l(metricsMutex);
+    if (metricsStream != nullptr)
+        metricsStream->flush();
+    metricsStream = stream;
+    metricsStreamFormat = format;
+    metricsLastFlushTime = SteadyClock::now();
+    if (metricsStream != nullptr && format == METRICS_CSV)
+        *metricsStream << "type,device,pass,kernelTime,bandwidth,perf,elapsed,"
+                "verifyLatency,degradedTime,upload,kernels,readback,compare,logging,"
+                "message" << std::endl;
+}
+
+void openMetricsFile()
+{
+    if (metricsFile == nullptr)
+        return;
+    metricsFileStream.open(metricsFile);
+    if (!metricsFileStream)
+        throw MyException("Can't open metrics file");
+    installMetricsSink(&metricsFileStream, metricsFormat);
+}
+
+static std::string escapeJSONString(const std::string& str)
+{
+    std::string out;
+    for (const char c: str)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (c == '\n')
+            out += "\\n";
+        else if ((unsigned char)c >= 0x20)
+            out += c;
+    }
+    return out;
+}
+
+static std::string escapeMetricsMessage(const char* message, int format)
+{
+    if (format != METRICS_CSV)
+        return escapeJSONString(message);
+    std::string out;
+    for (const char* p = message; *p != 0; p++)
+    {
+        if (*p == '"')
+            out += "\"\"";
+        else
+            out += (*p == '\n') ? ' ' : *p;
+    }
+    return out;
+}
+
+void emitMetricsRecord(const MetricsRecord& record)
+{
+    std::lock_guard<std::mutex> l(metricsMutex);
+    if (metricsStream == nullptr)
+        return;
+    const int format = metricsStreamFormat;
+    const double* stages = record.stageTimes;
+    char buf[512];
+    if (format == METRICS_CSV)
+        snprintf(buf, 512, "%s,%u,%u,%.9g,%.6g,%.6g,%.6f,%.6g,%.6f,%.6g,%.6g,%.6g,%.6g,%.6g,",
+                 metricsRecordTypeNames[record.type], record.id, record.passNum,
+                 record.kernelTime, record.bandwidth, record.perf,
+                 record.elapsedTime, record.verifyLatency, record.degradedTime,
+                 stages[0], stages[1], stages[2], stages[3], stages[4]);
+    else
+        snprintf(buf, 512, "{\"type\":\"%s\",\"device\":%u,\"pass\":%u,"
+                 "\"kernelTime\":%.9g,\"bandwidth\":%.6g,\"perf\":%.6g,"
+                 "\"elapsed\":%.6f,\"verifyLatency\":%.6g,\"degradedTime\":%.6f,"
+                 "\"stages\":{\"upload\":%.6g,\"kernels\":%.6g,\"readback\":%.6g,"
+                 "\"compare\":%.6g,\"logging\":%.6g}",
+                 metricsRecordTypeNames[record.type], record.id, record.passNum,
+                 record.kernelTime, record.bandwidth, record.perf,
+                 record.elapsedTime, record.verifyLatency, record.degradedTime,
+                 stages[0], stages[1], stages[2], stages[3], stages[4]);
+    std::string message;
+    if (record.message != nullptr)
+        message = escapeMetricsMessage(record.message, format);
+    
+    *metricsStream << buf;
+    if (format == METRICS_CSV)
+    {
+        if (record.message != nullptr)
+            *metricsStream << '"' << message << '"';
+    }
+    else
+    {
+        if (record.message != nullptr)
+            *metricsStream << ",\"message\":\"" << message << '"';
+        *metricsStream << '}';
+    }
+    *metricsStream << '\n';
+    const SteadyClock::time_point now = SteadyClock::now();
+    if (record.type != METRICS_PASS || now-metricsLastFlushTime >= metricsFlushPeriod)
+    {
+        metricsStream->flush();
+        metricsLastFlushTime = now;
+    }
+}
+
+/*
+ * asynchronous logger
+ */
+
+static GPUStressLogger* activeLogger = nullptr;
+
+void logTesterOutput(cxuint id, const std::string& text, bool error)
+{
+    if (activeLogger != nullptr && activeLogger->write(id, text, error))
+        return;
+    std::lock_guard<std::mutex> l(stdOutputMutex);
+    std::ostream* stream = (error) ? errStream : outStream;
+    *stream << text;
+    stream->flush();
+    handleOutput(id);
+}
+
+/* collects message of tester and writes it by logTesterOutput at end of scope */
+class TesterLog
+{
+private:
+    cxuint id;
+    bool error;
+    std::ostringstream oss;
+public:
+    explicit TesterLog(cxuint _id, bool _error = false) : id(_id), error(_error)
+    { }
+    ~TesterLog()
+    {
+        try
+        { logTesterOutput(id, oss.str(), error); }
+        catch(...)
+        { }
+    }
+    
+    template<typename T>
+    TesterLog& operator<<(const T& value)
+    {
+        oss << value;
+        return *this;
+    }
+    TesterLog& operator<<(std::ostream& (*manip)(std::ostream&))
+    {
+        oss << manip;
+        return *this;
+    }
+};
+
+static const size_t logRingSize = 1024; // must be power of 2
+
+GPUStressLogger::GPUStressLogger() : stopRequest(false)
+{ }
+
+GPUStressLogger::~GPUStressLogger()
+{
+    stop();
+}
+
+void GPUStressLogger::start(const std::vector<GPUStressTester*>& testers)
+{
+    if (!useAsyncLogger && logDirectory == nullptr)
+        return;
+    cxuint maxId = 0;
+    for (const GPUStressTester* tester: testers)
+        maxId = std::max(maxId, tester->getId());
+    rings = std::vector<Ring>(testers.empty() ? 0 : maxId+1);
+    for (Ring& ring: rings)
+    {
+        ring.entries.resize(logRingSize);
+        ring.head.store(0);
+        ring.tail.store(0);
+        ring.lineStart = true;
+    }
+    logFiles.assign(rings.size(), nullptr);
+    if (logDirectory != nullptr)
+        for (const GPUStressTester* tester: testers)
+        {
+            std::string filename = logDirectory;
+            filename += "/gpustress-";
+            filename += std::to_string(tester->getId());
+            filename += ".log";
+            std::ofstream* file = new std::ofstream(filename.c_str(), std::ios::app);
+            logFiles[tester->getId()] = file;
+            if (!*file)
+            {
+                stop();
+                throw MyException(std::string("Can't open log file ")+filename);
+            }
+            *file << "# " << tester->getPlatformName() << ":" <<
+                    tester->getDeviceName() << std::endl;
+        }
+    stopRequest = false;
+    writerThread = std::thread(&GPUStressLogger::run, this);
+    activeLogger = this;
+}
+
+void GPUStressLogger::stop()
+{
+    if (activeLogger == this)
+        activeLogger = nullptr;
+    if (writerThread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopRequest = true;
+        }
+        cond.notify_one();
+        writerThread.join();
+        drain(); // remaining output (testers are already finished)
+    }
+    for (std::ostream* file: logFiles)
+        delete file;
+    logFiles.clear();
+    rings.clear();
+}
+
+bool GPUStressLogger::write(cxuint id, const std::string& text, bool error)
+{
+    if (id >= rings.size())
+        return false;
+    Ring& ring = rings[id];
+    const RealtimeClock::time_point time = RealtimeClock::now();
+    size_t head = ring.head.load(std::memory_order_relaxed);
+    for (size_t pos = 0; pos < text.size(); )
+    {
+        // never drop output: wait for writer if ring is full
+        while (head - ring.tail.load(std::memory_order_acquire) == logRingSize)
+        {
+            ring.head.store(head, std::memory_order_release);
+            cond.notify_one();
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+        LogEntry& entry = ring.entries[head & (logRingSize-1)];
+        entry.time = time;
+        entry.error = error;
+        entry.length = std::min(text.size()-pos, sizeof(entry.text));
+        ::memcpy(entry.text, text.data()+pos, entry.length);
+        pos += entry.length;
+        head++;
+    }
+    // publish whole message at once
+    ring.head.store(head, std::memory_order_release);
+    return true;
+}
+
+static void writeLogTimestamp(std::ostream& os, RealtimeClock::time_point time)
+{
+    const time_t t = RealtimeClock::to_time_t(time);
+    const cxuint millis = std::chrono::duration_cast<std::chrono::milliseconds>(
+                time.time_since_epoch()).count() % 1000;
+    char buf[40];
+    const size_t len = strftime(buf, 32, "%Y-%m-%d %H:%M:%S", localtime(&t));
+    snprintf(buf+len, 8, ".%03u ", millis);
+    os << buf;
+}
+
+bool GPUStressLogger::drain()
+{
+    struct Chunk
+    {
+        cxuint id;
+        bool error;
+        std::string text;
+    };
+    std::vector<Chunk> chunks;
+    for (cxuint id = 0; id < rings.size(); id++)
+    {
+        Ring& ring = rings[id];
+        size_t tail = ring.tail.load(std::memory_order_relaxed);
+        const size_t head = ring.head.load(std::memory_order_acquire);
+        std::ostream* file = logFiles[id];
+        for (; tail != head; tail++)
+        {
+            const LogEntry& entry = ring.entries[tail & (logRingSize-1)];
+            if (chunks.empty() || chunks.back().id != id ||
+                chunks.back().error != entry.error)
+                chunks.push_back({ id, entry.error, std::string() });
+            chunks.back().text.append(entry.text, entry.length);
+            if (file == nullptr)
+                continue;
+            for (cxuint i = 0; i < entry.length; i++)
+            {
+                if (ring.lineStart)
+                {
+                    writeLogTimestamp(*file, entry.time);
+                    *file << ((entry.error) ? "[err] " : "[out] ");
+                }
+                file->put(entry.text[i]);
+                ring.lineStart = (entry.text[i] == '\n');
+            }
+        }
+        ring.tail.store(tail, std::memory_order_release);
+        if (file != nullptr)
+            file->flush();
+    }
+    if (chunks.empty())
+        return false;
+    
+    // one lock and one flush for whole batch
+    std::lock_guard<std::mutex> l(stdOutputMutex);
+    for (const Chunk& chunk: chunks)
+    {
+        *((chunk.error) ? errStream : outStream) << chunk.text;
+        handleOutput(chunk.id);
+    }
+    outStream->flush();
+    errStream->flush();
+    return true;
+}
+
+void GPUStressLogger::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopRequest)
+    {
+        lock.unlock();
+        const bool written = drain();
+        lock.lock();
+        if (!written && !stopRequest)
+            cond.wait_for(lock, std::chrono::milliseconds(20));
+    }
+}
+
+/*
+ * trace recorder
+ */
+
+static SteadyClock::time_point traceBaseTime;
+
+static const char* traceTrackNames[3] = { "host", "queue1", "queue2" };
+
+static int64_t getTraceHostTime()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                SteadyClock::now()-traceBaseTime).count();
+}
+
+GPUStressTester::TraceSpan::TraceSpan(GPUStressTester* thisTester, const char* thisName,
+            cl_ulong* thisStageNanos) : tester(thisTester), name(thisName),
+            stageNanos(thisStageNanos)
+{
+    start = (traceFile != nullptr || stageNanos != nullptr) ? getTraceHostTime() : 0;
+}
+
+GPUStressTester::TraceSpan::~TraceSpan()
+{
+    finish();
+}
+
+void GPUStressTester::TraceSpan::finish()
+{
+    if (name == nullptr || (traceFile == nullptr && stageNanos == nullptr))
+        return;
+    const int64_t duration = getTraceHostTime()-start;
+    if (traceFile != nullptr)
+        tester->addTraceEvent(name, TRACE_HOST, start, duration);
+    if (stageNanos != nullptr)
+        *stageNanos += duration;
+    name = nullptr;
+}
+
+void GPUStressTester::addTraceEvent(const char* name, cxuint track, int64_t start,
+            int64_t duration)
+{
+    if (traceEvents.empty())
+        traceEvents.resize(traceBufferSize);
+    // oldest events are overwritten
+    TraceEvent& event = traceEvents[traceEventsNum % traceEvents.size()];
+    event.name = name;
+    event.track = track;
+    event.start = start;
+    event.duration = duration;
+    traceEventsNum++;
+}
+
+void GPUStressTester::traceDeviceEvent(const char* name, cxuint track,
+            const cl::Event& event)
+{
+    try
+    {
+        cl_ulong queuedTime, startTime, endTime;
+        event.getProfilingInfo(CL_PROFILING_COMMAND_QUEUED, &queuedTime);
+        event.getProfilingInfo(CL_PROFILING_COMMAND_START, &startTime);
+        event.getProfilingInfo(CL_PROFILING_COMMAND_END, &endTime);
+        if (!traceDeviceOffsetSet)
+        {   /* first reset command was queued at traceAlignHostTime */
+            traceDeviceOffset = traceAlignHostTime - int64_t(queuedTime);
+            traceDeviceOffsetSet = true;
+        }
+        addTraceEvent(name, track, int64_t(startTime)+traceDeviceOffset,
+                    int64_t(endTime-startTime));
+    }
+    catch(const cl::Error&)
+    { } // no profiling info for this command
+}
+
+void GPUStressTester::writeTraceEvents(std::ostream& os, bool& first) const
+{
+    char buf[256];
+    for (cxuint track = 0; track < 3; track++)
+    {
+        snprintf(buf, 256, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,"
+                 "\"tid\":%u,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n",
+                 id, track, traceTrackNames[track]);
+        os << buf;
+        first = false;
+    }
+    os << ",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << id <<
+            ",\"args\":{\"name\":\"#" << id << " " <<
+            escapeJSONString(platformName + ":" + deviceName) << "\"}}";
+    
+    const size_t eventsNum = std::min(traceEventsNum, traceEvents.size());
+    const size_t firstEvent = traceEventsNum - eventsNum;
+    for (size_t i = firstEvent; i < traceEventsNum; i++)
+    {
+        const TraceEvent& event = traceEvents[i % traceEvents.size()];
+        snprintf(buf, 256, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,"
+                 "\"ts\":%.3f,\"dur\":%.3f}", event.name, id, event.track,
+                 double(event.start)*1e-3, double(event.duration)*1e-3);
+        os << buf;
+    }
+}
+
+void writeTraceFile(const std::vector<GPUStressTester*>& testers)
+{
+    if (traceFile == nullptr)
+        return;
+    std::ofstream ofs(traceFile);
+    if (!ofs)
+        throw MyException("Can't open trace file");
+    ofs << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    bool first = true;
+    for (const GPUStressTester* tester: testers)
+        tester->writeTraceEvents(ofs, first);
+    ofs << "\n]}\n";
+    if (!ofs)
+        throw MyException("Can't write trace file");
+}
+
 static const float examplePoly[5] = 
 { 4.43859953e+05,   1.13454169e+00,  -4.50175916e-06, -1.43865531e-12,   4.42133541e-18 };
 
+/* max number of mismatch indices reported by compare kernel */
+static const cxuint maxReportedMismatches = 16;
+
+static const char* verificationModeNames[3] = { "host", "device", "digest" };
+
+static const char* getBuiltinKernelSource(cxuint builtinKernel)
+{
+    switch(builtinKernel)
+    {
+        case 0:
+            return clKernel1Source;
+        case 1:
+            return clKernel2Source;
+        case 2:
+            return clKernelPWSource;
+        case 3:
+            return clKernelPW2Source;
+        default:
+            throw MyException("Unsupported builtin kernel!");
+    }
+}
+
+static void generateInitialValues(float* values, size_t itemsNum, bool polyWalker)
+{
+    std::mt19937_64 random;
+    if (!polyWalker)
+    {
+        for (size_t i = 0; i < itemsNum; i++)
+            values[i] = (float(random())/float(
+                        std::mt19937_64::max()-std::mt19937_64::min())-0.5f)*0.04f;
+    }
+    else
+    {   /* data for polywalker */
+        for (size_t i = 0; i < itemsNum; i++)
+            values[i] = (float(random())/float(
+                        std::mt19937_64::max()-std::mt19937_64::min()))*2e6 - 1e6;
+    }
+}
+
+// itemsNum in double, because items of whole test can overflow size_t
+static void computeKernelPerf(bool polyWalker, cxuint kitersNum, double itemsNum,
+            cl_ulong kernelTime, double& bandwidth, double& perf)
+{
+    bandwidth = 2.0*4.0*itemsNum / double(kernelTime);
+    if (!polyWalker)
+        perf = 2.0*3.0*double(kitersNum)*itemsNum / double(kernelTime);
+    else
+        perf = 8.0*double(kitersNum)*itemsNum / double(kernelTime);
+}
+
+// number of testers sharing host threads (set by createGPUStressTesters)
+static size_t compareTestersNum = 1;
+// defined in host comparator
+static size_t getCompareThreadsNum(size_t itemsNum);
+
 GPUStressTester::GPUStressTester(cxuint _id, cl::Device& _clDevice,
-        const GPUStressConfig& config)
+        const GPUStressConfig& config, const cl::Context* sharedContext)
 try :
-        id(_id), workFactor(config.workFactor),
+        id(_id), curSet(0), nextPassNum(1), reactor(nullptr), asyncWait(ASYNC_NONE),
+        workFactor(config.workFactor),
         blocksNum(config.blocksNum), passItersNum(config.passItersNum),
         kitersNum(config.kitersNum), useInputAndOutput(config.inputAndOutput),
-        initialValues(nullptr), toCompare(nullptr), results(nullptr)
+        toCompare(nullptr)
 {
     initialized = false;
     failed = false;
+    waitState = std::make_shared<WaitState>();
+    kernelChunksNum = 1;
+    calibKernelTime = 0;
+    lastPassNum = 0;
+    passesNum.store(0);
+    passBandwidth.store(0.0);
+    passPerf.store(0.0);
+    rollingBandwidth.store(0.0);
+    rollingPerf.store(0.0);
+    startTime = RealtimeClock::now();
     usePolyWalker = false;
+    useSharedContext = (sharedContext != nullptr);
     // set clDevice, after because can fails and pointers to free must be set
     clDevice = _clDevice;
     
@@ -408,34 +1087,22 @@ try :
     workSize = size_t(maxComputeUnits)*groupSize*workFactor;
     bufItemsNum = (workSize<<4)*blocksNum;
     
-    switch(config.builtinKernel)
-    {
-        case 0:
-            clKernelSource = clKernel1Source;
-            break;
-        case 1:
-            clKernelSource = clKernel2Source;
-            break;
-        case 2:
-            clKernelSource = clKernelPWSource;
-            usePolyWalker = true;
-            break;
-        case 3:
-            clKernelSource = clKernelPW2Source;
-            usePolyWalker = true;
-            break;
-        default:
-            throw MyException("Unsupported builtin kernel!");
-            break;
-    }
+    clKernelSource = getBuiltinKernelSource(config.builtinKernel);
+    usePolyWalker = (config.builtinKernel >= 2);
+    builtinKernel = config.builtinKernel;
     clKernelSourceSize = ::strlen(clKernelSource);
     
     {
         double devMemReqs = 0.0;
+        // buffers of all sets with pristine copy of initial values
         if (useInputAndOutput)
-            devMemReqs = (bufItemsNum<<4)/(1048576.0);
+            devMemReqs = pipelineDepth*(bufItemsNum<<3)/(1048576.0) +
+                    (bufItemsNum<<2)/(1048576.0);
         else
-            devMemReqs = (bufItemsNum<<3)/(1048576.0);
+            devMemReqs = pipelineDepth*(bufItemsNum<<2)/(1048576.0) +
+                    (bufItemsNum<<2)/(1048576.0);
+        if (verificationMode == VERIFY_DEVICE_COMPARE)
+            devMemReqs += (bufItemsNum<<2)/(1048576.0);
         
         std::lock_guard<std::mutex> l(stdOutputMutex);
         *outStream << "Preparing StressTester for\n  " <<
@@ -448,7 +1115,9 @@ try :
                 ", groupSize=" << groupSize <<
                 ", passIters=" << passItersNum <<
                 ", testType=" << config.builtinKernel <<
-                ",\n    inputAndOutput=" << (useInputAndOutput?"yes":"no") << std::endl;
+                ", pipelineDepth=" << pipelineDepth <<
+                ",\n    inputAndOutput=" << (useInputAndOutput?"yes":"no") <<
+                ", verification=" << verificationModeNames[verificationMode] << std::endl;
         handleOutput(id);
     }
     
@@ -460,38 +1129,73 @@ try :
         return;
     }
     
-    cl_context_properties clContextProps[3];
-    clContextProps[0] = CL_CONTEXT_PLATFORM;
-    clContextProps[1] = reinterpret_cast<cl_context_properties>(clPlatform());
-    clContextProps[2] = 0;
-    clContext = cl::Context(clDevice, clContextProps);
+    if (sharedContext == nullptr)
+    {
+        cl_context_properties clContextProps[3];
+        clContextProps[0] = CL_CONTEXT_PLATFORM;
+        clContextProps[1] = reinterpret_cast<cl_context_properties>(clPlatform());
+        clContextProps[2] = 0;
+        clContext = cl::Context(clDevice, clContextProps);
+    }
+    else // context shared with identical devices
+        clContext = *sharedContext;
     
-    clCmdQueue1 = cl::CommandQueue(clContext, clDevice);
-    clCmdQueue2 = cl::CommandQueue(clContext, clDevice);
+    // kernels are enqueued to first queue
+    queue1Profiling = (kernelSamplingPeriod != 0 || traceFile != nullptr ||
+                getMaxQueuedNanos() != 0.0);
+    clCmdQueue1 = cl::CommandQueue(clContext, clDevice,
+                queue1Profiling ? CL_QUEUE_PROFILING_ENABLE : 0);
+    clCmdQueue2 = cl::CommandQueue(clContext, clDevice,
+                (traceFile != nullptr) ? CL_QUEUE_PROFILING_ENABLE : 0);
     
-    clBuffer1 = cl::Buffer(clContext, CL_MEM_READ_WRITE, bufItemsNum<<2);
-    if (useInputAndOutput)
-        clBuffer2 = cl::Buffer(clContext, CL_MEM_READ_WRITE, bufItemsNum<<2);
-    clBuffer3 = cl::Buffer(clContext, CL_MEM_READ_WRITE, bufItemsNum<<2);
-    if (useInputAndOutput)
-        clBuffer4 = cl::Buffer(clContext, CL_MEM_READ_WRITE, bufItemsNum<<2);
+    clInitBuffer = cl::Buffer(clContext, CL_MEM_READ_ONLY, bufItemsNum<<2);
     
-    initialValues = new float[bufItemsNum];
-    toCompare = new float[bufItemsNum];
-    results = new float[bufItemsNum];
+    if (verificationMode == VERIFY_DEVICE_COMPARE)
+    {   /* golden results will be held only in device memory */
+        clGoldenBuffer = cl::Buffer(clContext, CL_MEM_READ_ONLY, bufItemsNum<<2);
+        buildVerifyKernels();
+    }
+    else if (verificationMode == VERIFY_DIGEST)
+    {   /* only digests of the golden results will be held */
+        buildVerifyKernels();
+        goldenDigests.resize(digestsNum);
+    }
+    else
+    {
+        toCompare = new float[bufItemsNum];
+        // comparing threads are created once for whole test
+        comparePool.start(getCompareThreadsNum(bufItemsNum)-1);
+    }
     
-    std::mt19937_64 random;
-    if (!usePolyWalker)
+    bufferSets.resize(pipelineDepth);
+    for (BufferSet& bufferSet: bufferSets)
     {
-        for (size_t i = 0; i < bufItemsNum; i++)
-            initialValues[i] = (float(random())/float(
-                        std::mt19937_64::max()-std::mt19937_64::min())-0.5f)*0.04f;
+        bufferSet.state = BUFSET_IDLE;
+        bufferSet.passNum = 0;
+        bufferSet.buffer1 = cl::Buffer(clContext, CL_MEM_READ_WRITE, bufItemsNum<<2);
+        if (useInputAndOutput)
+            bufferSet.buffer2 = cl::Buffer(clContext, CL_MEM_READ_WRITE, bufItemsNum<<2);
+        if (verificationMode == VERIFY_DEVICE_COMPARE)
+        {
+            bufferSet.clMismatchBuffer = cl::Buffer(clContext, CL_MEM_READ_WRITE,
+                    (maxReportedMismatches+1)<<2);
+            bufferSet.mismatches.resize(maxReportedMismatches+1);
+        }
+        else if (verificationMode == VERIFY_DIGEST)
+        {
+            bufferSet.clDigestBuffer = cl::Buffer(clContext, CL_MEM_WRITE_ONLY,
+                    digestsNum<<3);
+            bufferSet.digests.resize(digestsNum);
+        }
+        else
+            bufferSet.results.resize(bufItemsNum);
     }
-    else
-    {   /* data for polywalker */
-        for (size_t i = 0; i < bufItemsNum; i++)
-            initialValues[i] = (float(random())/float(
-                        std::mt19937_64::max()-std::mt19937_64::min()))*2e6 - 1e6;
+    
+    {   /* initial values are uploaded once and held only in device memory */
+        std::vector<float> initialValues(bufItemsNum);
+        generateInitialValues(initialValues.data(), bufItemsNum, usePolyWalker);
+        clCmdQueue1.enqueueWriteBuffer(clInitBuffer, CL_TRUE, size_t(0), bufItemsNum<<2,
+                initialValues.data());
     }
     
     calibrateKernel();
@@ -502,9 +1206,11 @@ try :
         handleOutput(id);
         return;
     }
+    for (BufferSet& bufferSet: bufferSets)
+        bufferSet.execEvents.resize(size_t(passItersNum)*kernelChunksNum);
     
-    clCmdQueue1.enqueueWriteBuffer(clBuffer1, CL_TRUE, size_t(0), bufItemsNum<<2,
-            initialValues);
+    BufferSet& firstSet = bufferSets[0];
+    resetBuffer(clCmdQueue1, firstSet.buffer1);
     
     clKernel.setArg(0, cl_uint(workSize));
     if (usePolyWalker)
@@ -518,10 +1224,13 @@ try :
     /* generate values to compare */
     if (!useInputAndOutput)
     {
-        clKernel.setArg(1, clBuffer1);
-        clKernel.setArg(2, clBuffer1);
+        clKernel.setArg(1, firstSet.buffer1);
+        clKernel.setArg(2, firstSet.buffer1);
     }
     
+    /* enqueue whole pass as one batch and wait only for last kernel,
+     * kernel is launched in chunks as in test (queue is in order) */
+    std::vector<cl::Event> goldenEvents;
     for (cxuint i = 0; i < passItersNum; i++)
     {
         if (stopAllStressTestersByUser.load())
@@ -531,30 +1240,32 @@ try :
         {
             if ((i&1) == 0)
             {
-                clKernel.setArg(1, clBuffer1);
-                clKernel.setArg(2, clBuffer2);
+                clKernel.setArg(1, firstSet.buffer1);
+                clKernel.setArg(2, firstSet.buffer2);
             }
             else
             {
-                clKernel.setArg(1, clBuffer2);
-                clKernel.setArg(2, clBuffer1);
+                clKernel.setArg(1, firstSet.buffer2);
+                clKernel.setArg(2, firstSet.buffer1);
             }
         }
-        cl::Event clEvent;
-        clCmdQueue1.enqueueNDRangeKernel(clKernel, cl::NDRange(0),
-                cl::NDRange(workSize), cl::NDRange(groupSize), nullptr, &clEvent);
-        try
-        { clEvent.wait(); }
-        catch(const cl::Error& err)
+        for (cxuint c = 0; c < kernelChunksNum; c++)
         {
-            if (err.err() != CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST)
+            goldenEvents.push_back(cl::Event());
+            enqueueKernelChunk(clCmdQueue1, c, nullptr, &goldenEvents.back());
+        }
+    }
+    if (!goldenEvents.empty())
+    {
+        try
+        { goldenEvents.back().wait(); }
+        catch(const cl::Error& err)
+        {
+            if (err.err() != CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST)
                 throw; // if other error
-            int eventStatus;
-            clEvent.getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS, &eventStatus);
-            char strBuf[64];
-            snprintf(strBuf, 64, "Failed NDRangeKernel with code: %d", eventStatus);
-            throw MyException(strBuf);
         }
+        for (const cl::Event& event: goldenEvents)
+            checkKernelEvent(event);
     }
     
     if (stopAllStressTestersByUser.load())
@@ -566,11 +1277,22 @@ try :
     }
     
     // get results
-    if (!useInputAndOutput || (passItersNum&1) == 0)
-        clCmdQueue1.enqueueReadBuffer(clBuffer1, CL_TRUE, size_t(0), bufItemsNum<<2,
-                    toCompare);
-    else //
-        clCmdQueue1.enqueueReadBuffer(clBuffer2, CL_TRUE, size_t(0), bufItemsNum<<2,
+    const cl::Buffer& goldenOutBuffer = getOutputBuffer(firstSet);
+    if (verificationMode == VERIFY_DEVICE_COMPARE)
+    {
+        clCmdQueue1.enqueueCopyBuffer(goldenOutBuffer, clGoldenBuffer, size_t(0), size_t(0),
+                    bufItemsNum<<2);
+        clCmdQueue1.finish();
+    }
+    else if (verificationMode == VERIFY_DIGEST)
+    {
+        cl::Event digestsEvent;
+        enqueueDigests(clCmdQueue1, goldenOutBuffer, firstSet, nullptr, &digestsEvent);
+        digestsEvent.wait();
+        goldenDigests = firstSet.digests;
+    }
+    else
+        clCmdQueue1.enqueueReadBuffer(goldenOutBuffer, CL_TRUE, size_t(0), bufItemsNum<<2,
                     toCompare);
     
     {
@@ -584,48 +1306,325 @@ try :
         *outStream << "out=" << i << ":" << toCompare[i] << '\n';
     outStream->flush();*/
     
+    if (useOutOfOrderQueues)
+        createOutOfOrderQueues();
+    
     initialized = true;
 }
 catch(...)
 {
     delete[] toCompare;
-    delete[] initialValues;
-    delete[] results;
     throw;
 }
 
 GPUStressTester::~GPUStressTester()
 {
+    {
+        std::lock_guard<std::mutex> l(stopWaitersMutex);
+        stopWaiters.erase(this);
+    }
     delete[] toCompare;
-    delete[] initialValues;
-    delete[] results;
 }
 
-void GPUStressTester::buildKernel(cxuint thisKitersNum, cxuint thisBlocksNum,
-                bool alwaysPrintBuildLog, bool whenCalibrates)
-{   // freeing resources
-    clKernel = cl::Kernel();
-    clProgram = cl::Program();
+void GPUStressTester::createOutOfOrderQueues()
+{
+    cl_command_queue_properties queueProps;
+    clDevice.getInfo(CL_DEVICE_QUEUE_PROPERTIES, &queueProps);
+    if ((queueProps & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0)
+    {
+        try
+        {
+            cl::CommandQueue cmdQueue1(clContext, clDevice,
+                        CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE |
+                        (queue1Profiling ? CL_QUEUE_PROFILING_ENABLE : 0));
+            cl::CommandQueue cmdQueue2(clContext, clDevice,
+                        CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE |
+                        ((traceFile != nullptr) ? CL_QUEUE_PROFILING_ENABLE : 0));
+            clCmdQueue1 = cmdQueue1;
+            clCmdQueue2 = cmdQueue2;
+            return;
+        }
+        catch(const cl::Error& error)
+        {
+            if (error.err() != CL_INVALID_QUEUE_PROPERTIES)
+                throw;
+        }
+    }
+    std::lock_guard<std::mutex> l(stdOutputMutex);
+    *outStream << "#" << id << " Out-of-order queues are not supported, "
+            "using in-order queues." << std::endl;
+    handleOutput(id);
+}
+
+void GPUStressTester::resetBuffer(cl::CommandQueue& cmdQueue, const cl::Buffer& buffer,
+            cl::Event* event)
+{
+    cmdQueue.enqueueCopyBuffer(clInitBuffer, buffer, size_t(0), size_t(0), bufItemsNum<<2,
+                nullptr, event);
+}
+
+/*
+ * program binaries cache
+ */
+
+static const char* programCacheMagic = "GPUSTRESSBIN1";
+
+static cl_ulong hashFNV1a(const void* data, size_t size,
+            cl_ulong hash = 0xcbf29ce484222325ULL)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// used in names of temporary files (other processes can write same files)
+static cxuint getProcessId()
+{
+#ifdef _WINDOWS
+    return GetCurrentProcessId();
+#else
+    return ::getpid();
+#endif
+}
+
+std::string GPUStressTester::getProgramCacheKey(const char* buildOptions) const
+{
+    std::string driverVersion;
+    clDevice.getInfo(CL_DRIVER_VERSION, &driverVersion);
+    char sourceHashBuf[20];
+    // whole source passed to build (with iterations prologue)
+    snprintf(sourceHashBuf, 20, "%016llx", (unsigned long long)
+             hashFNV1a(clKernelSource, clKernelSourceSize,
+                    hashFNV1a(clKernelItersSource, ::strlen(clKernelItersSource))));
+    return platformName + "\n" + deviceName + "\n" + driverVersion + "\n" +
+            sourceHashBuf + "\n" + buildOptions;
+}
+
+std::string GPUStressTester::getProgramCachePath(const std::string& cacheKey) const
+{
+    char nameBuf[24];
+    snprintf(nameBuf, 24, "%016llx.bin", (unsigned long long)
+             hashFNV1a(cacheKey.data(), cacheKey.size()));
+    std::string path = programCacheDir;
+    if (!path.empty() && path.back() != '/' && path.back() != '\\')
+        path += '/';
+    return path + nameBuf;
+}
+
+bool GPUStressTester::loadCachedProgram(const char* buildOptions, cl::Program& program)
+{
+    const std::string cacheKey = getProgramCacheKey(buildOptions);
+    std::ifstream ifs(getProgramCachePath(cacheKey).c_str(), std::ios::binary);
+    if (!ifs)
+        return false;
+    /* file: magic, key (both null-terminated), binary size, binary */
+    std::string magic, fileKey;
+    std::getline(ifs, magic, '\0');
+    std::getline(ifs, fileKey, '\0');
+    if (!ifs || magic != programCacheMagic || fileKey != cacheKey)
+        return false;
+    cl_ulong binarySize = 0;
+    ifs.read(reinterpret_cast<char*>(&binarySize), sizeof(cl_ulong));
+    if (!ifs || binarySize == 0 || binarySize > (1ULL<<30))
+        return false;
+    std::vector<char> binary(binarySize);
+    ifs.read(binary.data(), binarySize);
+    if (!ifs)
+        return false;
+    
+    try
+    {   /* shared context holds only identical devices, same binary for all them */
+        std::vector<cl::Device> clDevices;
+        clContext.getInfo(CL_CONTEXT_DEVICES, &clDevices);
+        cl::Program::Binaries clBinaries(clDevices.size(),
+                    std::make_pair(binary.data(), size_t(binarySize)));
+        program = cl::Program(clContext, clDevices, clBinaries);
+        program.build(buildOptions);
+    }
+    catch(const cl::Error&)
+    {   // invalid or outdated binary, just build program from source
+        program = cl::Program();
+        return false;
+    }
+    return true;
+}
+
+void GPUStressTester::storeCachedProgram(const cl::Program& program,
+                const char* buildOptions)
+{
+    std::vector<cl::Device> programDevices;
+    std::vector<size_t> binarySizes;
+    program.getInfo(CL_PROGRAM_DEVICES, &programDevices);
+    program.getInfo(CL_PROGRAM_BINARY_SIZES, &binarySizes);
+    size_t devIndex = 0;
+    while (devIndex < programDevices.size() && programDevices[devIndex]() != clDevice())
+        devIndex++;
+    if (devIndex >= binarySizes.size() || binarySizes[devIndex] == 0)
+        return; // no binary
+    /* get only binary for this device, other entries are skipped */
+    std::vector<char> binary(binarySizes[devIndex]);
+    std::vector<char*> binaryPtrs(binarySizes.size(), nullptr);
+    binaryPtrs[devIndex] = binary.data();
+    if (clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(char*)*binaryPtrs.size(),
+                binaryPtrs.data(), nullptr) != CL_SUCCESS)
+        return;
+    
+    const std::string cacheKey = getProgramCacheKey(buildOptions);
+    const std::string cachePath = getProgramCachePath(cacheKey);
+    /* write to temporary file, then rename it, because other tester
+     * (also in other process) can write same entry concurrently */
+    char suffixBuf[32];
+    snprintf(suffixBuf, 32, ".tmp%u-%u", getProcessId(), id);
+    const std::string tmpPath = cachePath + suffixBuf;
+    {
+        std::ofstream ofs(tmpPath.c_str(), std::ios::binary);
+        if (!ofs)
+            return;
+        const cl_ulong binarySize = binary.size();
+        ofs.write(programCacheMagic, ::strlen(programCacheMagic)+1);
+        ofs.write(cacheKey.c_str(), cacheKey.size()+1);
+        ofs.write(reinterpret_cast<const char*>(&binarySize), sizeof(cl_ulong));
+        ofs.write(binary.data(), binary.size());
+        if (!ofs)
+        {
+            ofs.close();
+            std::remove(tmpPath.c_str());
+            return;
+        }
+    }
+    // rename replaces entry atomically (if it fails, existing entry is kept)
+    if (std::rename(tmpPath.c_str(), cachePath.c_str()) != 0)
+        std::remove(tmpPath.c_str());
+}
+
+cl::Program GPUStressTester::buildProgram(const char* buildOptions)
+{
+    cl::Program program;
+    if (programCacheDir != nullptr && loadCachedProgram(buildOptions, program))
+        return program;
     
     cl::Program::Sources clSources;
+    clSources.push_back(std::make_pair(clKernelItersSource, ::strlen(clKernelItersSource)));
     clSources.push_back(std::make_pair(clKernelSource, clKernelSourceSize));
-    clProgram = cl::Program(clContext, clSources);
-    
-    char buildOptions[128];
+    program = cl::Program(clContext, clSources);
     try
+    { program.build(buildOptions); }
+    catch(const cl::Error& error)
     {
-        snprintf(buildOptions, 128, "-DGROUPSIZE=" SIZE_T_SPEC
-                "U -DKITERSNUM=%uU -DBLOCKSNUM=%uU",
-                groupSize, thisKitersNum, thisBlocksNum);
-        clProgram.build(buildOptions);
+        printBuildLog(program);
+        throw;
     }
-    catch(const cl::Error& error)
+    if (programCacheDir != nullptr)
+        storeCachedProgram(program, buildOptions);
+    return program;
+}
+
+/*
+ * registry of programs shared by testers of identical devices (in shared context)
+ */
+
+struct SharedProgram
+{
+    cl::Program program;
+    cxuint usersNum;
+    bool ready;
+};
+
+static std::mutex sharedProgramsMutex;
+static std::condition_variable sharedProgramsCond;
+static std::map<std::string, SharedProgram> sharedPrograms;
+
+cl::Program GPUStressTester::acquireSharedProgram(const char* source,
+            const char* buildOptions, SharedProgramRef& programRef,
+            const std::function<cl::Program()>& build)
+{
+    char keyBuf[64];
+    snprintf(keyBuf, 64, "%p:%p:", static_cast<void*>(clContext()),
+             static_cast<const void*>(source));
+    const std::string key = std::string(keyBuf) + buildOptions;
     {
-        printBuildLog();
+        std::unique_lock<std::mutex> lock(sharedProgramsMutex);
+        while (true)
+        {
+            auto it = sharedPrograms.find(key);
+            if (it == sharedPrograms.end())
+            {   // not yet built, this tester will build it
+                SharedProgram& entry = sharedPrograms[key];
+                entry.usersNum = 1;
+                entry.ready = false;
+                break;
+            }
+            if (it->second.ready)
+            {
+                it->second.usersNum++;
+                programRef.key = key;
+                return it->second.program;
+            }
+            // other tester builds this program
+            sharedProgramsCond.wait(lock);
+        }
+    }
+    
+    cl::Program program;
+    try
+    { program = build(); }
+    catch(...)
+    {   // waiting testers will try to build program themselves
+        std::lock_guard<std::mutex> l(sharedProgramsMutex);
+        sharedPrograms.erase(key);
+        sharedProgramsCond.notify_all();
         throw;
     }
+    std::lock_guard<std::mutex> l(sharedProgramsMutex);
+    SharedProgram& entry = sharedPrograms[key];
+    entry.program = program;
+    entry.ready = true;
+    programRef.key = key;
+    sharedProgramsCond.notify_all();
+    return program;
+}
+
+void GPUStressTester::SharedProgramRef::release()
+{
+    if (key.empty())
+        return;
+    std::lock_guard<std::mutex> l(sharedProgramsMutex);
+    auto it = sharedPrograms.find(key);
+    if (it != sharedPrograms.end() && --it->second.usersNum == 0)
+        sharedPrograms.erase(it);
+    key.clear();
+}
+
+GPUStressTester::SharedProgramRef::~SharedProgramRef()
+{ release(); }
+
+void GPUStressTester::buildKernel(cxuint thisKitersNum, cxuint thisBlocksNum,
+                bool alwaysPrintBuildLog, bool whenCalibrates, bool runtimeIters)
+{   // freeing resources
+    clKernel = cl::Kernel();
+    clProgram = cl::Program();
+    sharedProgramRef.release();
+    
+    char buildOptions[128];
+    if (!runtimeIters)
+        snprintf(buildOptions, 128, "-DGROUPSIZE=" SIZE_T_SPEC
+                "U -DKITERSNUM=%uU -DBLOCKSNUM=%uU",
+                groupSize, thisKitersNum, thisBlocksNum);
+    else // kitersNum and blocksNum given in kernel arguments
+        snprintf(buildOptions, 128, "-DGROUPSIZE=" SIZE_T_SPEC "U -DRUNTIME_ITERS",
+                groupSize);
+    
+    if (useSharedContext)
+        clProgram = acquireSharedProgram(clKernelSource, buildOptions, sharedProgramRef,
+                    [this, &buildOptions]() { return buildProgram(buildOptions); });
+    else
+        clProgram = buildProgram(buildOptions);
     if (alwaysPrintBuildLog)
-        printBuildLog();
+        printBuildLog(clProgram);
     clKernel = cl::Kernel(clProgram, "gpuStress");
     
     // fixing groupSize and workSize if needed and if possible
@@ -644,292 +1643,602 @@ void GPUStressTester::buildKernel(cxuint thisKitersNum, cxuint thisBlocksNum,
         workFactor <<= shifts;
         {
             std::lock_guard<std::mutex> l(stdOutputMutex);
-            if (whenCalibrates)
-                *outStream << std::endl;
             *outStream << "Fixed groupSize for\n  " <<
                 "#" << id << " " << platformName << ":" << deviceName <<
                 "\n    SetUp: workFactor=" << workFactor <<
                 ", groupSize=" << groupSize << std::endl;
-            if (whenCalibrates)
-            {
-                *outStream << "  Calibration progress:";
-                outStream->flush();
-            }
             handleOutput(id);
         }
-        buildKernel(thisKitersNum, thisBlocksNum, alwaysPrintBuildLog, whenCalibrates);
+        buildKernel(thisKitersNum, thisBlocksNum, alwaysPrintBuildLog, whenCalibrates,
+                    runtimeIters);
     }
 }
 
-void GPUStressTester::calibrateKernel()
+/*
+ * kernel timing engine
+ */
+
+/* estimates kernel time from samples, noise is relative standard deviation,
+ * returns half width of 95% confidence interval */
+static double estimateKernelTime(std::vector<cl_ulong>& samples, cl_ulong& kernelTime,
+            double& noise)
 {
-    cxuint bestKitersNum = 1;
-    double bestBandwidth = 0.0;
-    double bestPerf = 0.0;
-    cl_ulong bestKernelTime = CL_ULONG_MAX;
-    cl_ulong kernelTime = 0;
-    cl::CommandQueue profCmdQueue(clContext, clDevice, CL_QUEUE_PROFILING_ENABLE);
-    
-    const bool profileKernelAfterBuilt = (kitersNum != 0);
-    if (kitersNum == 0)
-    {
-        if (useInputAndOutput)
-            clCmdQueue1.enqueueWriteBuffer(clBuffer1, CL_TRUE, size_t(0), bufItemsNum<<2,
-                    initialValues);
-        
-        {
-            std::lock_guard<std::mutex> l(stdOutputMutex);
-            *outStream << "Calibrating Kernel for\n  " <<
-                "#" << id << " " << platformName << ":" << deviceName << "..." << std::endl;
-            *outStream << "  Calibration progress:";
-            outStream->flush();
-            handleOutput(id);
-        }
-        
-        try
-        {
-        for (cxuint curKitersNum = 1; curKitersNum <= 40; curKitersNum++)
-        {
-            if (stopAllStressTestersByUser.load())
-            {
-                std::lock_guard<std::mutex> l(stdOutputMutex);
-                *outStream << std::endl;
-                handleOutput(id);
-                return;
-            }
-            
-            if (((curKitersNum-1)%5) == 0)
-            {   /* print progress of calibration */
-                std::lock_guard<std::mutex> l(stdOutputMutex);
-                *outStream << " " << ((curKitersNum-1)*100/40) << "%";
-                outStream->flush();
-                handleOutput(id);
-            }
-            buildKernel(curKitersNum, blocksNum, false, true);
-            
-            clKernel.setArg(0, cl_uint(workSize));
-            clKernel.setArg(1, clBuffer1);
-            if (useInputAndOutput)
-                clKernel.setArg(2, clBuffer2);
-            else
-                clKernel.setArg(2, clBuffer1);
-            
-            if (usePolyWalker)
-            {
-                clKernel.setArg(3, examplePoly[0]);
-                clKernel.setArg(4, examplePoly[1]);
-                clKernel.setArg(5, examplePoly[2]);
-                clKernel.setArg(6, examplePoly[3]);
-                clKernel.setArg(7, examplePoly[4]);
-            }
-            
-            cl_ulong kernelTimes[5];
-            for (cxuint k = 0; k < 5; k++)
-            {
-                if (stopAllStressTestersByUser.load())
-                {
-                    std::lock_guard<std::mutex> l(stdOutputMutex);
-                    *outStream << std::endl;
-                    handleOutput(id);
-                    return; // if stopped by user
-                }
-                
-                if (!useInputAndOutput) // ensure always this same input data for kernel
-                    clCmdQueue1.enqueueWriteBuffer(clBuffer1, CL_TRUE, size_t(0),
-                            bufItemsNum<<2, initialValues);
-                
-                cl::Event profEvent;
-                profCmdQueue.enqueueNDRangeKernel(clKernel, cl::NDRange(0),
-                        cl::NDRange(workSize), cl::NDRange(groupSize), nullptr, &profEvent);
-                try
-                { profEvent.wait(); }
-                catch(const cl::Error& err)
-                {
-                    if (err.err() != CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST)
-                        throw; // if other error
-                    int eventStatus;
-                    profEvent.getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS, &eventStatus);
-                    char strBuf[64];
-                    snprintf(strBuf, 64, "Failed NDRangeKernel with code: %d", eventStatus);
-                    throw MyException(strBuf);
-                }
-                
-                cl_ulong eventStartTime, eventEndTime;
-                profEvent.getProfilingInfo(CL_PROFILING_COMMAND_START, &eventStartTime);
-                profEvent.getProfilingInfo(CL_PROFILING_COMMAND_END, &eventEndTime);
-                kernelTimes[k] = eventEndTime-eventStartTime;
-            }
-            
-            // sort kernels times
-            for (cxuint k = 0; k < 5; k++)
-            {
-                for (cxuint l = k+1; l < 5; l++)
-                    if (kernelTimes[k]>kernelTimes[l])
-                        std::swap(kernelTimes[k], kernelTimes[l]);
-                //*outStream << "SortedTime: " << kernelTimes[k] << std::endl;
-            }
-            
-            cxuint acceptedToAvg = 1;
-            for (; acceptedToAvg < 5; acceptedToAvg++)
-                if (double(kernelTimes[acceptedToAvg]-kernelTimes[0]) >
-                            double(kernelTimes[0])*0.07)
-                    break;
-            //*outStream << "acceptedToAvg: " << acceptedToAvg << std::endl;
-            const cl_ulong currentTime =
-                std::accumulate(kernelTimes, kernelTimes+acceptedToAvg, 0ULL)/acceptedToAvg;
-            /* *outStream << "avg is: " << currentTime << std::endl;
-            *outStream << "..." << std::endl;*/
-            
-            double currentBandwidth;
-            currentBandwidth = 2.0*4.0*double(bufItemsNum) / double(currentTime);
-            double currentPerf;
-            if (!usePolyWalker)
-                currentPerf = 2.0*3.0*double(curKitersNum)*double(bufItemsNum) /
-                        double(currentTime);
-            else
-                currentPerf = 8.0*double(curKitersNum)*double(bufItemsNum) /
-                        double(currentTime);
-            
-            if (currentBandwidth*currentPerf > bestBandwidth*bestPerf)
-            {
-                bestKitersNum = curKitersNum;
-                bestPerf = currentPerf;
-                bestBandwidth = currentBandwidth;
-                bestKernelTime = currentTime;
-            }
-        }
-        } // try/catch
-        catch(...)
-        {
-            std::lock_guard<std::mutex> l(stdOutputMutex);
-            *outStream << std::endl;
-            handleOutput(id);
-            throw;
-        }
-        
-        {   /* if choosen we compile real code */
-            std::lock_guard<std::mutex> l(stdOutputMutex);
-            *outStream << " 100%" << std::endl;
-            *outStream << "Kernel calibrated for\n  " <<
-                    "#" << id << " " << platformName << ":" << deviceName << "\n"
-                    "  BestKitersNum: " << bestKitersNum << ", Bandwidth: " << bestBandwidth <<
-                    " GB/s, Performance: " << bestPerf << " GFLOPS" << std::endl;
-            handleOutput(id);
-        }
-        
-        kernelTime = bestKernelTime;
+    std::sort(samples.begin(), samples.end());
+    const size_t n = samples.size();
+    double estimate, sigma, halfWidth;
+    if (timingEstimator == TIMING_MEDIAN)
+    {   /* median and median absolute deviation */
+        estimate = (n&1) ? double(samples[n>>1]) :
+                0.5*(double(samples[(n>>1)-1]) + double(samples[n>>1]));
+        std::vector<double> deviations(n);
+        for (size_t i = 0; i < n; i++)
+            deviations[i] = ::fabs(double(samples[i])-estimate);
+        std::sort(deviations.begin(), deviations.end());
+        const double mad = (n&1) ? deviations[n>>1] :
+                0.5*(deviations[(n>>1)-1] + deviations[n>>1]);
+        sigma = 1.4826*mad;
+        // median is less efficient than mean
+        halfWidth = 1.96*1.2533*sigma/::sqrt(double(n));
     }
     else
+    {   /* mean of samples without 20% lowest and 20% highest */
+        const size_t trimmed = n/5;
+        const size_t m = n - 2*trimmed;
+        double sum = 0.0;
+        for (size_t i = trimmed; i < n-trimmed; i++)
+            sum += double(samples[i]);
+        estimate = sum / double(m);
+        double sqSum = 0.0;
+        for (size_t i = trimmed; i < n-trimmed; i++)
+            sqSum += (double(samples[i])-estimate)*(double(samples[i])-estimate);
+        sigma = (m > 1) ? ::sqrt(sqSum/double(m-1)) : 0.0;
+        halfWidth = 1.96*sigma/::sqrt(double(m));
+    }
+    kernelTime = cl_ulong(estimate+0.5);
+    noise = (estimate != 0.0) ? sigma/estimate : 0.0;
+    return halfWidth;
+}
+
+/* runs warm-up and samples until confidence interval is narrow enough,
+ * runSample returns time of single kernel execution.
+ * returns false if stopped by user */
+template<typename RunSample>
+static bool measureTiming(RunSample runSample, cxuint maxSamplesNum,
+            cl_ulong& kernelTime, double& noise)
+{
+    for (cxuint k = 0; k < cxuint(timingWarmup); k++)
     {
-        bestKitersNum = kitersNum;
-        std::lock_guard<std::mutex> l(stdOutputMutex);
-        *outStream << "Kernel KitersNum: " << bestKitersNum << std::endl;
-        handleOutput(id);
+        if (stopAllStressTestersByUser.load())
+            return false; // if stopped by user
+        runSample();
     }
-    
-    if (stopAllStressTestersByUser.load())
-        return;
-    kitersNum = bestKitersNum;
-    buildKernel(kitersNum, blocksNum, true, false);
-    
-    if (profileKernelAfterBuilt)
+    std::vector<cl_ulong> samples;
+    while (samples.size() < maxSamplesNum)
     {
-        if (useInputAndOutput)
-            clCmdQueue1.enqueueWriteBuffer(clBuffer1, CL_TRUE, size_t(0), bufItemsNum<<2,
-                    initialValues);
-        
-        clKernel.setArg(0, cl_uint(workSize));
-        clKernel.setArg(1, clBuffer1);
-        if (useInputAndOutput)
-            clKernel.setArg(2, clBuffer2);
-        else
-            clKernel.setArg(2, clBuffer1);
-        
-        if (usePolyWalker)
+        if (stopAllStressTestersByUser.load())
+            return false; // if stopped by user
+        samples.push_back(runSample());
+        if (timingConfidence != 0 && samples.size() >= 3)
         {
-            clKernel.setArg(3, examplePoly[0]);
-            clKernel.setArg(4, examplePoly[1]);
-            clKernel.setArg(5, examplePoly[2]);
-            clKernel.setArg(6, examplePoly[3]);
-            clKernel.setArg(7, examplePoly[4]);
+            std::vector<cl_ulong> sorted = samples;
+            cl_ulong estimate;
+            double curNoise;
+            const double halfWidth = estimateKernelTime(sorted, estimate, curNoise);
+            if (halfWidth <= double(estimate)*timingConfidence*0.01)
+                break; // precise enough
         }
-        
-        cl_ulong kernelTimes[5];
-        for (cxuint k = 0; k < 5; k++)
-        {
-            if (stopAllStressTestersByUser.load())
-                return; // if stopped by user
-            
-            if (!useInputAndOutput) // ensure always this same input data for kernel
-                clCmdQueue1.enqueueWriteBuffer(clBuffer1, CL_TRUE, size_t(0),
-                        bufItemsNum<<2, initialValues);
-            
-            cl::Event profEvent;
-            profCmdQueue.enqueueNDRangeKernel(clKernel, cl::NDRange(0),
-                    cl::NDRange(workSize), cl::NDRange(groupSize), nullptr, &profEvent);
-            try
-            { profEvent.wait(); }
-            catch(const cl::Error& err)
-            {
-                if (err.err() != CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST)
-                    throw; // if other error
-                int eventStatus;
-                profEvent.getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS, &eventStatus);
-                char strBuf[64];
-                snprintf(strBuf, 64, "Failed NDRangeKernel with code: %d", eventStatus);
-                throw MyException(strBuf);
-            }
-            
-            cl_ulong eventStartTime, eventEndTime;
-            profEvent.getProfilingInfo(CL_PROFILING_COMMAND_START, &eventStartTime);
-            profEvent.getProfilingInfo(CL_PROFILING_COMMAND_END, &eventEndTime);
-            kernelTimes[k] = eventEndTime-eventStartTime;
+    }
+    estimateKernelTime(samples, kernelTime, noise);
+    return true;
+}
+
+bool GPUStressTester::measureKernelTime(cl::CommandQueue& profCmdQueue, cl_ulong& kernelTime,
+            double& noise, cxuint maxSamplesNum)
+{
+    auto runSample = [this, &profCmdQueue]() -> cl_ulong
+    {
+        std::vector<cl::Event> resetWaitList;
+        if (!useInputAndOutput)
+        {   // ensure always this same input data for kernel
+            resetWaitList.resize(1);
+            resetBuffer(clCmdQueue1, bufferSets[0].buffer1, &resetWaitList[0]);
+            clCmdQueue1.flush();
         }
         
-        // sort kernels times
-        for (cxuint k = 0; k < 5; k++)
+        std::vector<cl::Event> chunkEvents(kernelChunksNum);
+        for (cxuint c = 0; c < kernelChunksNum; c++)
+            enqueueKernelChunk(profCmdQueue, c, (c == 0 && !resetWaitList.empty()) ?
+                        &resetWaitList : nullptr, &chunkEvents[c]);
+        cl::Event& profEvent = chunkEvents.back();
+        try
+        { profEvent.wait(); }
+        catch(const cl::Error& err)
         {
-            for (cxuint l = k+1; l < 5; l++)
-                if (kernelTimes[k]>kernelTimes[l])
-                    std::swap(kernelTimes[k], kernelTimes[l]);
-            //*outStream << "SortedTime: " << kernelTimes[k] << std::endl;
+            if (err.err() != CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST)
+                throw; // if other error
+            int eventStatus;
+            profEvent.getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS, &eventStatus);
+            char strBuf[64];
+            snprintf(strBuf, 64, "Failed NDRangeKernel with code: %d", eventStatus);
+            throw MyException(strBuf);
         }
         
-        cxuint acceptedToAvg = 1;
-        for (; acceptedToAvg < 5; acceptedToAvg++)
-            if (double(kernelTimes[acceptedToAvg]-kernelTimes[0]) >
-                        double(kernelTimes[0])*0.07)
-                break;
-        //*outStream << "acceptedToAvg: " << acceptedToAvg << std::endl;
-        kernelTime = std::accumulate(kernelTimes, kernelTimes+acceptedToAvg, 0ULL)/acceptedToAvg;
+        cl_ulong eventStartTime, eventEndTime;
+        chunkEvents[0].getProfilingInfo(CL_PROFILING_COMMAND_START, &eventStartTime);
+        profEvent.getProfilingInfo(CL_PROFILING_COMMAND_END, &eventEndTime);
+        const cl_ulong sampleTime = eventEndTime-eventStartTime;
+        if (kernelTimeSlice != 0)
+        {   /* probes (also while calibrating) must not exceed time slice,
+             * split kernel more for next samples if launch was too long */
+            cl_ulong maxLaunchTime = 0;
+            for (const cl::Event& event: chunkEvents)
+            {
+                event.getProfilingInfo(CL_PROFILING_COMMAND_START, &eventStartTime);
+                event.getProfilingInfo(CL_PROFILING_COMMAND_END, &eventEndTime);
+                maxLaunchTime = std::max(maxLaunchTime, eventEndTime-eventStartTime);
+            }
+            if (maxLaunchTime > cl_ulong(kernelTimeSlice)*1000000ULL)
+                splitKernel(std::max(sampleTime, maxLaunchTime*kernelChunksNum));
+        }
+        return sampleTime;
+    };
+    return measureTiming(runSample, (maxSamplesNum != 0) ? maxSamplesNum : timingSamples,
+                kernelTime, noise);
+}
+
+void GPUStressTester::enqueueKernelChunk(cl::CommandQueue& cmdQueue, cxuint chunk,
+                const std::vector<cl::Event>* waitList, cl::Event* event)
+{
+    /* kernels step by n (workSize) instead of global size,
+     * hence chunk computes exactly this same words as in whole kernel */
+    const size_t offset = (kernelChunksNum > 1) ? size_t(chunk)*chunkSize : 0;
+    const size_t size = (kernelChunksNum > 1) ? std::min(chunkSize, workSize-offset) :
+                workSize;
+    cmdQueue.enqueueNDRangeKernel(clKernel, cl::NDRange(offset), cl::NDRange(size),
+                cl::NDRange(groupSize), waitList, event);
+}
+
+void GPUStressTester::splitKernel(cl_ulong kernelTime)
+{
+    kernelChunksNum = 1;
+    chunkSize = workSize;
+    const cl_ulong timeSlice = cl_ulong(kernelTimeSlice)*1000000ULL;
+    if (timeSlice == 0 || kernelTime <= timeSlice)
+        return;
+    // chunks are aligned to work groups
+    const size_t groupsNum = workSize / groupSize;
+    const size_t minChunksNum = std::min(groupsNum,
+                size_t((kernelTime+timeSlice-1) / timeSlice));
+    const size_t chunkGroups = (groupsNum + minChunksNum-1) / minChunksNum;
+    chunkSize = chunkGroups*groupSize;
+    kernelChunksNum = (groupsNum + chunkGroups-1) / chunkGroups;
+}
+
+bool GPUStressTester::setupKernelChunks(cl::CommandQueue& profCmdQueue, cl_ulong kernelTime)
+{
+    splitKernel(kernelTime);
+    if (kernelChunksNum == 1)
+        return true;
+    
+    if (useInputAndOutput)
+    {
+        resetBuffer(clCmdQueue1, bufferSets[0].buffer1);
+        clCmdQueue1.finish();
+    }
+    setKernelArgs(bufferSets[0].buffer1, bufferSets[0].buffer2);
+    cl_ulong chunkedTime;
+    double chunkedNoise;
+    if (!measureKernelTime(profCmdQueue, chunkedTime, chunkedNoise))
+        return false; // if stopped by user
+    std::lock_guard<std::mutex> l(stdOutputMutex);
+    *outStream << "Kernel split for\n  " <<
+            "#" << id << " " << platformName << ":" << deviceName << "\n"
+            "  Launches: " << kernelChunksNum << " (time slice: " << kernelTimeSlice <<
+            " ms), ChunkedKernelTime: " << (double(chunkedTime)*1e-9) <<
+            "s, Throughput loss: " <<
+            ((double(chunkedTime)-double(kernelTime))*100.0/double(kernelTime)) <<
+            "%" << std::endl;
+    handleOutput(id);
+    return true;
+}
+
+void GPUStressTester::setKernelArgs(const cl::Buffer& buffer1, const cl::Buffer& buffer2)
+{
+    clKernel.setArg(0, cl_uint(workSize));
+    clKernel.setArg(1, buffer1);
+    if (useInputAndOutput)
+        clKernel.setArg(2, buffer2);
+    else
+        clKernel.setArg(2, buffer1);
+    
+    if (usePolyWalker)
+    {
+        clKernel.setArg(3, examplePoly[0]);
+        clKernel.setArg(4, examplePoly[1]);
+        clKernel.setArg(5, examplePoly[2]);
+        clKernel.setArg(6, examplePoly[3]);
+        clKernel.setArg(7, examplePoly[4]);
+    }
+}
+
+/*
+ * calibration profiles
+ */
+
+static std::mutex calibrationProfilesMutex;
+
+/* profiles file has one line per profile, fields are separated by tabs:
+ * deviceName, driverVersion, testType, groupSize, workFactor, blocksNum (key),
+ * kitersNum, kernelTime, bandwidth, perf (stepsPerWait is computed from current
+ * maxQueuedTime and stopLatency) */
+static const cxuint calibrationProfileKeyFields = 6;
+static const cxuint calibrationProfileFields = 10;
+
+static std::vector<std::string> splitProfileLine(const std::string& line)
+{
+    std::vector<std::string> fields;
+    size_t pos = 0;
+    while (true)
+    {
+        const size_t tabPos = line.find('\t', pos);
+        if (tabPos == std::string::npos)
+        {
+            fields.push_back(line.substr(pos));
+            break;
+        }
+        fields.push_back(line.substr(pos, tabPos-pos));
+        pos = tabPos+1;
+    }
+    return fields;
+}
+
+std::string GPUStressTester::getCalibrationProfileKey() const
+{
+    std::string driverVersion;
+    clDevice.getInfo(CL_DRIVER_VERSION, &driverVersion);
+    char buf[64];
+    snprintf(buf, 64, "%u%s\t%u\t%u\t%u", builtinKernel,
+             useInputAndOutput ? "io" : "", cxuint(groupSize), workFactor, blocksNum);
+    return deviceName + "\t" + trimSpaces(driverVersion) + "\t" + buf;
+}
+
+bool GPUStressTester::loadCalibrationProfile(const std::string& key,
+            CalibrationProfile& profile)
+{
+    std::lock_guard<std::mutex> l(calibrationProfilesMutex);
+    std::ifstream ifs(calibrationProfilesFile);
+    if (!ifs)
+        return false;
+    std::string line;
+    while (std::getline(ifs, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        const std::vector<std::string> fields = splitProfileLine(line);
+        if (fields.size() != calibrationProfileFields)
+            continue; // malformed
+        std::string lineKey = fields[0];
+        for (cxuint i = 1; i < calibrationProfileKeyFields; i++)
+            lineKey += "\t" + fields[i];
+        if (lineKey != key)
+            continue;
+        profile.kitersNum = ::strtoul(fields[6].c_str(), nullptr, 10);
+        profile.kernelTime = ::strtoull(fields[7].c_str(), nullptr, 10);
+        profile.bandwidth = ::strtod(fields[8].c_str(), nullptr);
+        profile.perf = ::strtod(fields[9].c_str(), nullptr);
+        // reject broken entry
+        return profile.kitersNum != 0 && profile.kitersNum <= 40 &&
+                profile.kernelTime != 0;
+    }
+    return false;
+}
+
+void GPUStressTester::storeCalibrationProfile(const std::string& key,
+            const CalibrationProfile& profile)
+{
+    char valuesBuf[128];
+    snprintf(valuesBuf, 128, "\t%u\t%llu\t%g\t%g", profile.kitersNum,
+             (unsigned long long)profile.kernelTime, profile.bandwidth, profile.perf);
+    
+    std::lock_guard<std::mutex> l(calibrationProfilesMutex);
+    // keep other profiles, replace profile with same key
+    std::vector<std::string> lines;
+    {
+        std::ifstream ifs(calibrationProfilesFile);
+        std::string line;
+        while (std::getline(ifs, line))
+        {
+            if (line.compare(0, key.size(), key) == 0 && line.size() > key.size() &&
+                line[key.size()] == '\t')
+                continue;
+            lines.push_back(line);
+        }
+    }
+    if (lines.empty())
+        lines.push_back("# GPUStress calibration profiles");
+    lines.push_back(key + valuesBuf);
+    
+    // temporary file unique per process, other processes can use same profiles file
+    char suffixBuf[32];
+    snprintf(suffixBuf, 32, ".tmp%u", getProcessId());
+    const std::string tmpPath = std::string(calibrationProfilesFile) + suffixBuf;
+    {
+        std::ofstream ofs(tmpPath.c_str());
+        if (!ofs)
+            return;
+        for (const std::string& line: lines)
+            ofs << line << '\n';
+        if (!ofs)
+        {
+            ofs.close();
+            std::remove(tmpPath.c_str());
+            return;
+        }
+    }
+    if (std::rename(tmpPath.c_str(), calibrationProfilesFile) != 0)
+        std::remove(tmpPath.c_str());
+}
+
+static const cxuint maxCalibKitersNum = 40;
+
+void GPUStressTester::calibrateKernel()
+{
+    cxuint bestKitersNum = 1;
+    cl_ulong kernelTime = 0;
+    cl::CommandQueue profCmdQueue(clContext, clDevice, CL_QUEUE_PROFILING_ENABLE);
+    const bool useProfiles = (kitersNum == 0 && calibrationProfilesFile != nullptr);
+    /* key from config before calibration (groupSize can be fixed later),
+     * same key is used to store profile */
+    const std::string profileKey = useProfiles ? getCalibrationProfileKey() : std::string();
+    CalibrationProfile profile;
+    bool profileHit = false;
+    
+    if (useProfiles && loadCalibrationProfile(profileKey, profile))
+    {
+        buildKernel(profile.kitersNum, blocksNum, true, false);
+        splitKernel(profile.kernelTime); // probe in launches under time slice
+        profileHit = true;
+        if (calibrationRevalidate)
+        {   /* quick check whether stored kernel time is still valid */
+            if (useInputAndOutput)
+            {
+                resetBuffer(clCmdQueue1, bufferSets[0].buffer1);
+                clCmdQueue1.finish();
+            }
+            setKernelArgs(bufferSets[0].buffer1, bufferSets[0].buffer2);
+            cl_ulong probeTime;
+            double probeNoise;
+            if (!measureKernelTime(profCmdQueue, probeTime, probeNoise, 1))
+                return; // if stopped by user
+            if (::fabs(double(probeTime)-double(profile.kernelTime)) >
+                        double(profile.kernelTime)*0.1)
+            {
+                std::lock_guard<std::mutex> l(stdOutputMutex);
+                *outStream << "Calibration profile is outdated for\n  " <<
+                        "#" << id << " " << platformName << ":" << deviceName << "\n"
+                        "  StoredKernelTime: " << (double(profile.kernelTime)*1e-9) <<
+                        "s, ProbedKernelTime: " << (double(probeTime)*1e-9) << "s" << std::endl;
+                handleOutput(id);
+                profileHit = false;
+            }
+        }
+        if (profileHit)
+        {
+            kitersNum = profile.kitersNum;
+            kernelTime = profile.kernelTime;
+            std::lock_guard<std::mutex> l(stdOutputMutex);
+            *outStream << "Calibration profile loaded for\n  " <<
+                    "#" << id << " " << platformName << ":" << deviceName << "\n"
+                    "  KitersNum: " << kitersNum << ", Bandwidth: " << profile.bandwidth <<
+                    " GB/s, Performance: " << profile.perf << " GFLOPS" << std::endl;
+            handleOutput(id);
+        }
+    }
+    
+    if (profileHit)
+        bestKitersNum = kitersNum;
+    else if (kitersNum == 0)
+    {
+        if (useInputAndOutput)
+        {
+            resetBuffer(clCmdQueue1, bufferSets[0].buffer1);
+            clCmdQueue1.finish();
+        }
+        
+        {
+            std::lock_guard<std::mutex> l(stdOutputMutex);
+            *outStream << "Calibrating Kernel for\n  " <<
+                "#" << id << " " << platformName << ":" << deviceName << "..." << std::endl;
+            handleOutput(id);
+        }
+        
+        const std_time_point calibStartTime = SteadyClock::now();
+        /* probes[kitersNum] - objective (bandwidth*perf), zero if not probed */
+        std::vector<double> probes(maxCalibKitersNum+1, 0.0);
+        std::vector<double> probeNoises(maxCalibKitersNum+1, 0.0);
+        cxuint probesNum = 0;
+        bool budgetExceeded = false;
+        bool stoppedByUser = false;
+        double bestBandwidth = 0.0;
+        double bestPerf = 0.0;
         
-        double currentBandwidth;
-        currentBandwidth = 2.0*4.0*double(bufItemsNum) / double(kernelTime);
-        double currentPerf;
-        if (!usePolyWalker)
-            currentPerf = 2.0*3.0*double(kitersNum)*double(bufItemsNum) /
-                    double(kernelTime);
+        // returns false if stopped by user or if budget exceeded
+        auto probeKitersNum = [&](cxuint curKitersNum) -> bool
+        {
+            if (probes[curKitersNum] != 0.0)
+                return true; // already probed
+            if (calibrationBudget != 0 && probesNum != 0 &&
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                    SteadyClock::now()-calibStartTime).count() >= calibrationBudget*1000LL)
+            {
+                budgetExceeded = true;
+                return false;
+            }
+            clKernel.setArg((usePolyWalker) ? 8 : 3, cl_uint(curKitersNum));
+            cl_ulong currentTime;
+            double currentNoise;
+            if (!measureKernelTime(profCmdQueue, currentTime, currentNoise))
+            {
+                stoppedByUser = true;
+                return false;
+            }
+            double currentBandwidth, currentPerf;
+            computeKernelPerf(usePolyWalker, curKitersNum, bufItemsNum, currentTime,
+                        currentBandwidth, currentPerf);
+            probes[curKitersNum] = currentBandwidth*currentPerf;
+            probeNoises[curKitersNum] = currentNoise;
+            probesNum++;
+            if (currentBandwidth*currentPerf > bestBandwidth*bestPerf)
+            {
+                bestKitersNum = curKitersNum;
+                bestPerf = currentPerf;
+                bestBandwidth = currentBandwidth;
+            }
+            return true;
+        };
+        
+        // one program for all steps of calibration
+        buildKernel(0, blocksNum, false, true, true);
+        setKernelArgs(bufferSets[0].buffer1, bufferSets[0].buffer2);
+        clKernel.setArg(((usePolyWalker) ? 8 : 3) + 1, cl_uint(blocksNum));
+        
+        if (calibrationMode == CALIBRATE_SWEEP)
+        {
+            for (cxuint curKitersNum = 1; curKitersNum <= maxCalibKitersNum; curKitersNum++)
+            {
+                if (((curKitersNum-1)%10) == 0)
+                {   /* print progress of calibration (whole lines, devices calibrate
+                     * concurrently) */
+                    std::lock_guard<std::mutex> l(stdOutputMutex);
+                    *outStream << "#" << id << " Calibration progress: " <<
+                            ((curKitersNum-1)*100/maxCalibKitersNum) << "%" << std::endl;
+                    handleOutput(id);
+                }
+                if (!probeKitersNum(curKitersNum))
+                    break;
+            }
+        }
         else
-            currentPerf = 8.0*double(kitersNum)*double(bufItemsNum) /
-                    double(kernelTime);
+        {   /* coarse-to-fine: probe coarse grid, then probe around best
+             * kitersNum with halved step until step is below tolerance */
+            cxuint step = 8;
+            for (cxuint curKitersNum = 1; curKitersNum <= maxCalibKitersNum; curKitersNum += step)
+                if (!probeKitersNum(curKitersNum))
+                    break;
+            if (!budgetExceeded && !stoppedByUser)
+                probeKitersNum(maxCalibKitersNum);
+            
+            while (step > cxuint(calibrationTolerance) && !budgetExceeded && !stoppedByUser)
+            {
+                step >>= 1;
+                {   /* print progress of calibration */
+                    std::lock_guard<std::mutex> l(stdOutputMutex);
+                    *outStream << "#" << id << " Calibration progress: step=" <<
+                            step << std::endl;
+                    handleOutput(id);
+                }
+                const cxuint centerKitersNum = bestKitersNum;
+                if (centerKitersNum > step)
+                    if (!probeKitersNum(centerKitersNum-step))
+                        break;
+                if (centerKitersNum+step <= maxCalibKitersNum)
+                    probeKitersNum(centerKitersNum+step);
+            }
+        }
+        
+        if (stoppedByUser)
+            return;
+        
+        {   /* if choosen we compile real code */
+            std::lock_guard<std::mutex> l(stdOutputMutex);
+            *outStream << "#" << id << " Calibration progress: 100%" << std::endl;
+            if (budgetExceeded)
+                *outStream << "  Calibration time budget exceeded" << std::endl;
+            *outStream << "Kernel calibrated for\n  " <<
+                    "#" << id << " " << platformName << ":" << deviceName << "\n"
+                    "  BestKitersNum: " << bestKitersNum << ", Bandwidth: " << bestBandwidth <<
+                    " GB/s, Performance: " << bestPerf << " GFLOPS\n"
+                    "  Probes: " << probesNum << ", objective (bandwidth*perf) curve:";
+            cxuint printed = 0;
+            for (cxuint k = 1; k <= maxCalibKitersNum; k++)
+                if (probes[k] != 0.0)
+                {
+                    *outStream << (((printed++)%8) == 0 ? "\n   " : "") <<
+                            " " << k << ":" << probes[k] <<
+                            "~" << (probeNoises[k]*100.0) << "%";
+                }
+            *outStream << std::endl;
+            handleOutput(id);
+        }
+    }
+    else
+    {
+        bestKitersNum = kitersNum;
+        std::lock_guard<std::mutex> l(stdOutputMutex);
+        *outStream << "Kernel KitersNum: " << bestKitersNum << std::endl;
+        handleOutput(id);
+    }
+    
+    if (stopAllStressTestersByUser.load())
+        return;
+    if (!profileHit)
+    {
+        kitersNum = bestKitersNum;
+        buildKernel(kitersNum, blocksNum, true, false);
+        
+        /* calibration uses kernel with runtime loop bounds,
+         * so always profile final specialized kernel */
+        if (useInputAndOutput)
+        {
+            resetBuffer(clCmdQueue1, bufferSets[0].buffer1);
+            clCmdQueue1.finish();
+        }
+        setKernelArgs(bufferSets[0].buffer1, bufferSets[0].buffer2);
+        double kernelNoise;
+        if (!measureKernelTime(profCmdQueue, kernelTime, kernelNoise))
+            return; // if stopped by user
+        double currentBandwidth, currentPerf;
+        computeKernelPerf(usePolyWalker, kitersNum, bufItemsNum, kernelTime,
+                    currentBandwidth, currentPerf);
         {
             std::lock_guard<std::mutex> l(stdOutputMutex);
             *outStream << "Kernel performance for\n  " <<
                     "#" << id << " " << platformName << ":" << deviceName << "\n"
                     "  KitersNum: " << kitersNum << ", Bandwidth: " << currentBandwidth <<
-                    " GB/s, Performance: " << currentPerf << " GFLOPS" << std::endl;
+                    " GB/s, Performance: " << currentPerf << " GFLOPS"
+                    ", Noise: " << (kernelNoise*100.0) << "%" << std::endl;
             handleOutput(id);
         }
+        
+        if (useProfiles)
+        {
+            profile.kitersNum = kitersNum;
+            profile.kernelTime = kernelTime;
+            profile.bandwidth = currentBandwidth;
+            profile.perf = currentPerf;
+            storeCalibrationProfile(profileKey, profile);
+        }
     }
     
     // determine how many iterations can be queued at same time
+    const double maxQueuedNanos = getMaxQueuedNanos();
     if (kernelTime != 0)
-        stepsPerWait = ::ceil(3e8 / double(kernelTime));
+        stepsPerWait = ::ceil(((maxQueuedNanos != 0.0) ? maxQueuedNanos : 3e8) /
+                    double(kernelTime));
     else // force 1000 if kernelTime is zero
         stepsPerWait = 1000;
     
     if (stepsPerWait < 2)
         stepsPerWait = 2;
+    if (!setupKernelChunks(profCmdQueue, kernelTime))
+        return; // if stopped by user
+    calibKernelTime = kernelTime;
+    {
+        MetricsRecord record = makeMetricsRecord(METRICS_CALIBRATION);
+        computeKernelPerf(usePolyWalker, kitersNum, bufItemsNum, kernelTime,
+                    record.bandwidth, record.perf);
+        emitMetricsRecord(record);
+    }
     {
         cl_device_type devType;
         if (kernelTime >= 4000000000ULL)
@@ -950,14 +2259,260 @@ void GPUStressTester::calibrateKernel()
                     "stopping test. You can exit from application immediately when test\n"
                     "can't be stopped\n" << std::endl;
         }
+        if (stopLatency != 0 && double(kernelTime)/kernelChunksNum > double(stopLatency)*1e6)
+            *outStream << "WARNING! Kernel time exceeds stop latency limit (" <<
+                    stopLatency << " ms)! Test can't be stopped in this time.\n" << std::endl;
         handleOutput(id);
     }
 }
 
-void GPUStressTester::printBuildLog()
+/*
+ * host comparator
+ */
+
+/* min number of words compared by single thread */
+static const size_t minCompareChunkSize = 1U<<20;
+
+struct CompareStats
+{
+    size_t mismatchesNum;
+    size_t firstMismatch;
+    size_t lastMismatch;
+    cl_ulong maxULPDistance;
+    size_t bitFlips[32];
+};
+
+static bool isChunkEqual(const cl_uint* golden, const cl_uint* results, size_t itemsNum)
+{
+    size_t i = 0;
+    cl_uint diff = 0;
+#if defined(__AVX2__)
+    __m256i acc = _mm256_setzero_si256();
+    for (; i+8 <= itemsNum; i += 8)
+        acc = _mm256_or_si256(acc, _mm256_xor_si256(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(golden+i)),
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(results+i))));
+    diff = !_mm256_testz_si256(acc, acc);
+#elif defined(HAVE_SSE2_COMPARE)
+    __m128i acc = _mm_setzero_si128();
+    for (; i+4 <= itemsNum; i += 4)
+        acc = _mm_or_si128(acc, _mm_xor_si128(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(golden+i)),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(results+i))));
+    diff = (_mm_movemask_epi8(_mm_cmpeq_epi32(acc, _mm_setzero_si128())) != 0xffff);
+#endif
+    for (; i < itemsNum; i++)
+        diff |= golden[i]^results[i];
+    return diff == 0;
+}
+
+static inline cl_long orderedFloatBits(cl_uint v)
+{
+    return (v & 0x80000000U) ? -cl_long(v & 0x7fffffffU) : cl_long(v);
+}
+
+/* called only when chunk mismatches, offset is index of first word of chunk */
+static void collectCompareStats(const cl_uint* golden, const cl_uint* results,
+            size_t itemsNum, size_t offset, CompareStats& stats)
+{
+    for (size_t i = 0; i < itemsNum; i++)
+    {
+        const cl_uint diff = golden[i]^results[i];
+        if (diff == 0)
+            continue;
+        if (stats.mismatchesNum == 0)
+            stats.firstMismatch = offset+i;
+        stats.lastMismatch = offset+i;
+        stats.mismatchesNum++;
+        for (cxuint b = 0; b < 32; b++)
+            stats.bitFlips[b] += (diff>>b)&1;
+        const cl_long dist = orderedFloatBits(golden[i]) - orderedFloatBits(results[i]);
+        stats.maxULPDistance = std::max(stats.maxULPDistance,
+                    cl_ulong(dist >= 0 ? dist : -dist));
+    }
+}
+
+static void compareChunk(const cl_uint* golden, const cl_uint* results,
+            size_t itemsNum, size_t offset, CompareStats& stats)
+{
+    if (!isChunkEqual(golden, results, itemsNum))
+        collectCompareStats(golden, results, itemsNum, offset, stats);
+}
+
+static size_t getCompareThreadsNum(size_t itemsNum)
+{
+    /* every tester has own comparing threads,
+     * so divide all threads between testers to avoid oversubscription */
+    const size_t allThreadsNum = (compareThreadsNum != 0) ? compareThreadsNum :
+                std::max(1U, std::thread::hardware_concurrency());
+    const size_t threadsNum = std::max(size_t(1), allThreadsNum/compareTestersNum);
+    return std::max(size_t(1), std::min(threadsNum, itemsNum/minCompareChunkSize));
+}
+
+WorkerPool::WorkerPool() : task(nullptr), tasksNum(0), generation(0), pendingWorkers(0),
+            stopRequest(false)
+{ }
+
+WorkerPool::~WorkerPool()
+{
+    stop();
+}
+
+void WorkerPool::start(size_t workersNum)
+{
+    stopRequest = false;
+    for (size_t i = 0; i < workersNum; i++)
+        threads.push_back(std::thread(&WorkerPool::runWorker, this, i));
+}
+
+void WorkerPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        stopRequest = true;
+    }
+    cond.notify_all();
+    for (std::thread& thread: threads)
+        thread.join();
+    threads.clear();
+}
+
+void WorkerPool::runWorker(size_t index)
+{
+    cxuint lastGeneration = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        cond.wait(lock, [this, lastGeneration]
+                { return stopRequest || generation != lastGeneration; });
+        if (stopRequest)
+            return;
+        lastGeneration = generation;
+        const size_t taskIndex = index+1;
+        if (taskIndex < tasksNum)
+        {
+            lock.unlock();
+            (*task)(taskIndex);
+            lock.lock();
+        }
+        if (--pendingWorkers == 0)
+            doneCond.notify_one();
+    }
+}
+
+void WorkerPool::run(size_t thisTasksNum, const std::function<void(size_t)>& thisTask)
+{
+    if (thisTasksNum == 0)
+        return;
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        task = &thisTask;
+        tasksNum = thisTasksNum;
+        pendingWorkers = threads.size();
+        generation++;
+    }
+    cond.notify_all();
+    thisTask(0);
+    std::unique_lock<std::mutex> lock(mutex);
+    doneCond.wait(lock, [this] { return pendingWorkers == 0; });
+}
+
+/* returns true if buffers are equal */
+static bool compareResultsOnHost(WorkerPool& pool, const float* golden,
+            const float* results, size_t itemsNum, CompareStats& stats)
+{
+    const cl_uint* g = reinterpret_cast<const cl_uint*>(golden);
+    const cl_uint* r = reinterpret_cast<const cl_uint*>(results);
+    const size_t threadsNum = pool.getThreadsNum();
+    // chunk size is aligned to 16 words
+    const size_t chunkSize = ((itemsNum + threadsNum-1) / threadsNum + 15) & ~size_t(15);
+    
+    std::vector<CompareStats> chunkStats(threadsNum);
+    ::memset(chunkStats.data(), 0, sizeof(CompareStats)*threadsNum);
+    pool.run(threadsNum, [g, r, itemsNum, chunkSize, &chunkStats](size_t t)
+    {
+        const size_t offset = t*chunkSize;
+        if (offset < itemsNum)
+            compareChunk(g+offset, r+offset, std::min(chunkSize, itemsNum-offset),
+                        offset, chunkStats[t]);
+    });
+    
+    ::memset(&stats, 0, sizeof(CompareStats));
+    for (const CompareStats& cs: chunkStats)
+    {
+        if (cs.mismatchesNum == 0)
+            continue;
+        if (stats.mismatchesNum == 0)
+            stats.firstMismatch = cs.firstMismatch;
+        stats.lastMismatch = cs.lastMismatch;
+        stats.mismatchesNum += cs.mismatchesNum;
+        stats.maxULPDistance = std::max(stats.maxULPDistance, cs.maxULPDistance);
+        for (cxuint b = 0; b < 32; b++)
+            stats.bitFlips[b] += cs.bitFlips[b];
+    }
+    return stats.mismatchesNum == 0;
+}
+
+cl::Program GPUStressTester::buildVerifyProgram()
+{
+    cl::Program::Sources clSources;
+    clSources.push_back(std::make_pair(clVerifyKernelSource,
+                ::strlen(clVerifyKernelSource)));
+    clSources.push_back(std::make_pair(clDigestKernelSource,
+                ::strlen(clDigestKernelSource)));
+    cl::Program program(clContext, clSources);
+    try
+    { program.build(""); }
+    catch(const cl::Error& error)
+    {
+        printBuildLog(program);
+        throw;
+    }
+    return program;
+}
+
+void GPUStressTester::buildVerifyKernels()
+{
+    if (useSharedContext)
+        clVerifyProgram = acquireSharedProgram(clVerifyKernelSource, "", verifyProgramRef,
+                    [this]() { return buildVerifyProgram(); });
+    else
+        clVerifyProgram = buildVerifyProgram();
+    if (verificationMode == VERIFY_DEVICE_COMPARE)
+    {
+        clCompareKernel = cl::Kernel(clVerifyProgram, "compareResults");
+        clCompareKernel.setArg(0, cl_uint(bufItemsNum>>2));
+        clCompareKernel.setArg(1, clGoldenBuffer);
+        clCompareKernel.setArg(4, cl_uint(maxReportedMismatches));
+        return;
+    }
+    
+    clDigestKernel = cl::Kernel(clVerifyProgram, "digestResults");
+    clDigestKernel.getWorkGroupInfo(clDevice, CL_KERNEL_WORK_GROUP_SIZE, &digestGroupSize);
+    digestGroupSize = std::min(digestGroupSize, groupSize);
+    digestsNum = (workSize + digestGroupSize-1) / digestGroupSize;
+    clDigestKernel.setArg(0, cl_uint(bufItemsNum>>2));
+    clDigestKernel.setArg(3, cl::__local(digestGroupSize<<3));
+}
+
+void GPUStressTester::enqueueDigests(cl::CommandQueue& cmdQueue, const cl::Buffer& outBuffer,
+                BufferSet& bufferSet, const std::vector<cl::Event>* waitList,
+                cl::Event* event)
+{
+    std::vector<cl::Event> readWaitList(1);
+    clDigestKernel.setArg(1, outBuffer);
+    clDigestKernel.setArg(2, bufferSet.clDigestBuffer);
+    cmdQueue.enqueueNDRangeKernel(clDigestKernel, cl::NDRange(0),
+                cl::NDRange(digestsNum*digestGroupSize), cl::NDRange(digestGroupSize),
+                waitList, &readWaitList[0]);
+    cmdQueue.enqueueReadBuffer(bufferSet.clDigestBuffer, CL_FALSE, size_t(0),
+                digestsNum<<3, bufferSet.digests.data(), &readWaitList, event);
+}
+
+void GPUStressTester::printBuildLog(const cl::Program& program)
 {
     std::string buildLog;
-    clProgram.getBuildInfo(clDevice, CL_PROGRAM_BUILD_LOG, &buildLog);
+    program.getBuildInfo(clDevice, CL_PROGRAM_BUILD_LOG, &buildLog);
     std::lock_guard<std::mutex> l(stdOutputMutex);
     *outStream << "Program build log:\n  " <<
             platformName << ":" << deviceName << "\n:--------------------\n" <<
@@ -992,12 +2547,85 @@ void GPUStressTester::printStatus(cxuint passNum)
              cxuint((startMillis/60000)%60), cxuint((startMillis/1000)%60),
              cxuint(startMillis%1000));
     
-    std::lock_guard<std::mutex> l(stdOutputMutex);
-    *outStream << "#" << id << " " << platformName << ":" << deviceName <<
+    TesterLog log(id);
+    log << "#" << id << " " << platformName << ":" << deviceName <<
             " passed PASS #" << passNum << "\n"
             "Approx. bandwidth: " << bandwidth << " GB/s, "
             "Approx. perf: " << perf << " GFLOPS, elapsed: " << timeStrBuf << std::endl;
-    handleOutput(id);
+    
+    const cl_ulong sampledCount = kernelTimes.getCount();
+    if (sampledCount != 0)
+    {
+        if (sampledCount != lastSampledCount)
+        {   /* device times from sampled kernels since last status */
+            const cl_ulong sampledTimeSum = kernelTimes.getTimeSum();
+            const cl_ulong intervalTimeSum = sampledTimeSum-lastSampledTimeSum;
+            const cl_ulong intervalCount = sampledCount-lastSampledCount;
+            lastSampledCount = sampledCount;
+            lastSampledTimeSum = sampledTimeSum;
+            double gpuBandwidth, gpuPerf;
+            // sampled times are times of single launches (chunks of kernel)
+            computeKernelPerf(usePolyWalker, kitersNum, bufItemsNum,
+                    intervalTimeSum*kernelChunksNum/intervalCount, gpuBandwidth, gpuPerf);
+            log << "GPU bandwidth: " << gpuBandwidth << " GB/s, "
+                    "GPU perf: " << gpuPerf << " GFLOPS, ";
+        }
+        else // percentiles are from all samples
+            log << "GPU bandwidth and perf: no new samples, ";
+        log << "kernel time p50: " <<
+                (double(kernelTimes.getQuantile(0.5))*1e-6) << " ms, p99: " <<
+                (double(kernelTimes.getQuantile(0.99))*1e-6) << " ms, max: " <<
+                (double(kernelTimes.getMaxTime())*1e-6) << " ms" << std::endl;
+    }
+}
+
+KernelTimeHistogram::KernelTimeHistogram() : count(0), timeSum(0), maxTime(0)
+{
+    for (std::atomic<cl_ulong>& bucket: buckets)
+        bucket.store(0, std::memory_order_relaxed);
+}
+
+static cxuint getKernelTimeBucket(cl_ulong kernelTime)
+{
+    if (kernelTime < 8)
+        return kernelTime;
+    cxuint exp = 63;
+    while ((kernelTime & (1ULL<<exp)) == 0)
+        exp--;
+    // 3 bits after leading bit select bucket in octave
+    return (exp-2)*8 + ((kernelTime >> (exp-3)) & 7);
+}
+
+void KernelTimeHistogram::record(cl_ulong kernelTime)
+{
+    const cxuint index = getKernelTimeBucket(kernelTime);
+    buckets[index].fetch_add(1, std::memory_order_relaxed);
+    timeSum.fetch_add(kernelTime, std::memory_order_relaxed);
+    if (kernelTime > maxTime.load(std::memory_order_relaxed))
+        maxTime.store(kernelTime, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_release);
+}
+
+cl_ulong KernelTimeHistogram::getQuantile(double quantile) const
+{
+    const cl_ulong total = getCount();
+    if (total == 0)
+        return 0;
+    const cl_ulong rank = std::max(cl_ulong(1), cl_ulong(::ceil(quantile*double(total))));
+    cl_ulong counted = 0;
+    for (cxuint i = 0; i < bucketsNum; i++)
+    {
+        counted += buckets[i].load(std::memory_order_relaxed);
+        if (counted >= rank)
+        {
+            if (i < 8)
+                return i;
+            const cxuint exp = i/8 + 2;
+            // upper bound of bucket, but not greater than max time
+            return std::min(getMaxTime(), cl_ulong(((8ULL + (i&7) + 1) << (exp-3)) - 1));
+        }
+    }
+    return getMaxTime();
 }
 
 void GPUStressTester::throwFailedComputations(cxuint passNum)
@@ -1012,449 +2640,1629 @@ void GPUStressTester::throwFailedComputations(cxuint passNum)
              passNum, cxuint(startMillis/3600000), cxuint((startMillis/60000)%60),
              cxuint((startMillis/1000)%60), cxuint(startMillis%1000));
     if (!exitIfAllFails)
-        stopAllStressTestersIfFail.store(true);
+        stopAllStressTesters(false);
     throw MyException(strBuf);
 }
 
-void GPUStressTester::runTest()
-try
+bool GPUStressTester::checkExitRequest()
 {
-    bool run1Exec = false;
-    bool run2Exec = false;
-    bool result1Checked = false;
-    bool result2Checked = false;
-    std::vector<cl::Event> exec1Events(passItersNum);
-    std::vector<cl::Event> exec2Events(passItersNum);
-    clKernel.setArg(0, cl_uint(workSize));
-    if (usePolyWalker)
+    if (stopAllStressTestersIfFail.load())
     {
-        clKernel.setArg(3, examplePoly[0]);
-        clKernel.setArg(4, examplePoly[1]);
-        clKernel.setArg(5, examplePoly[2]);
-        clKernel.setArg(6, examplePoly[3]);
-        clKernel.setArg(7, examplePoly[4]);
+        TesterLog log(id);
+        log << "#" << id << " Exiting, because some device failed." << std::endl;
+        return true;
+    }
+    if (stopAllStressTestersByUser.load())
+    {
+        TesterLog log(id);
+        log << "#" << id << " Exiting, because user stopped test." << std::endl;
+        return true;
+    }
+    return false;
+}
+
+// returns true if event completed or failed
+static bool isEventFinished(const cl::Event& event)
+{
+    int eventStatus;
+    event.getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS, &eventStatus);
+    return eventStatus <= CL_COMPLETE;
+}
+
+void GPUStressTester::beginBufferSet(BufferSet& bufferSet)
+{
+    bufferSet.passNum = nextPassNum++;
+    /* reset buffer without blocking, first kernel waits for it */
+    bufferSet.state = BUFSET_UPLOADING;
+    std::fill(bufferSet.stageNanos, bufferSet.stageNanos+PASS_STAGES_NUM, 0);
+    {
+        TraceSpan span(this, "upload", &bufferSet.stageNanos[PASS_STAGE_UPLOAD]);
+        resetBuffer(clCmdQueue1, bufferSet.buffer1, &bufferSet.resetEvent);
     }
+    if (bufferSet.passNum == 1 && traceFile != nullptr)
+        traceAlignHostTime = getTraceHostTime();
     
-    cxuint pass1Num = 1;
-    cxuint pass2Num = 2;
-    try
+    bufferSet.state = BUFSET_EXECUTING;
+    bufferSet.nextKernel = 0;
+}
+
+GPUStressTester::KernelsStatus GPUStressTester::enqueueKernels(BufferSet& bufferSet)
+{
+    TraceSpan span(this, "enqueue", &bufferSet.stageNanos[PASS_STAGE_KERNELS]);
+    /* dependencies are explicit (also for out-of-order queues): first kernel waits
+     * for reset and for last kernel of previous pass, next kernel for its predecessor */
+    std::vector<cl::Event> waitList;
+    if (!useInputAndOutput)
     {
-    startTime = RealtimeClock::now();
-    lastTime = SteadyClock::now();
+        clKernel.setArg(1, bufferSet.buffer1);
+        clKernel.setArg(2, bufferSet.buffer1);
+    }
     
-    while (true)
+    std::vector<cl::Event>& execEvents = bufferSet.execEvents;
+    const cxuint launchesNum = execEvents.size();
+    for (cxuint i = bufferSet.nextKernel; i < launchesNum; i++)
     {
-        if (stopAllStressTestersIfFail.load())
-        {
-            std::lock_guard<std::mutex> l(stdOutputMutex);
-            *outStream << "#" << id << " Exiting, because some device failed." << std::endl;
-            handleOutput(id);
-            break;
-        }
-        if (stopAllStressTestersByUser.load())
-        {
-            std::lock_guard<std::mutex> l(stdOutputMutex);
-            *outStream << "#" << id << " Exiting, because user stopped test." << std::endl;
-            handleOutput(id);
-            break;
-        }
-        
-        clCmdQueue2.enqueueWriteBuffer(clBuffer1, CL_TRUE, size_t(0), bufItemsNum<<2,
-                initialValues);
-        /* run execution 1 */
-        if (!useInputAndOutput)
+        if (stopAllStressTestersIfFail.load() || stopAllStressTestersByUser.load())
         {
-            clKernel.setArg(1, clBuffer1);
-            clKernel.setArg(2, clBuffer1);
+            bufferSet.state = BUFSET_IDLE;
+            return KERNELS_STOPPED;
         }
-        
-        cxuint stepsAfterWait = 0;
-        bool allIsExecuted = true;
-        for (cxuint i = 0; i < passItersNum; i++)
+        const cxuint iter = i / kernelChunksNum;
+        if (useInputAndOutput)
         {
-            if (stopAllStressTestersIfFail.load() || stopAllStressTestersByUser.load())
+            if ((iter&1) == 0)
             {
-                allIsExecuted = false;
-                break;
+                clKernel.setArg(1, bufferSet.buffer1);
+                clKernel.setArg(2, bufferSet.buffer2);
             }
-            if (useInputAndOutput)
+            else
             {
-                if ((i&1) == 0)
-                {
-                    clKernel.setArg(1, clBuffer1);
-                    clKernel.setArg(2, clBuffer2);
-                }
-                else
-                {
-                    clKernel.setArg(1, clBuffer2);
-                    clKernel.setArg(2, clBuffer1);
-                }
-            }
-            clCmdQueue1.enqueueNDRangeKernel(clKernel, cl::NDRange(0),
-                    cl::NDRange(workSize), cl::NDRange(groupSize), nullptr, &exec1Events[i]);
-            stepsAfterWait++;
-            if (stepsAfterWait >= stepsPerWait && i+((stepsPerWait+1)>>1) < passItersNum)
-            {   /* wait for ndrange kernel and ensure fluent working */
-                stepsAfterWait = 0;
-                try
-                { exec1Events[i-1].wait(); }
-                catch(const cl::Error& err)
-                {
-                    if (err.err() != CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST)
-                        throw; // if other error
-                    int eventStatus;
-                    exec1Events[i-1].getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS, &eventStatus);
-                    if (eventStatus < 0)
-                    {
-                        char strBuf[64];
-                        snprintf(strBuf, 64, "Failed NDRangeKernel with code: %d", eventStatus);
-                        throw MyException(strBuf);
-                    }
-                }
+                clKernel.setArg(1, bufferSet.buffer2);
+                clKernel.setArg(2, bufferSet.buffer1);
             }
         }
-        if (allIsExecuted)
-        {
-            run1Exec = true;
-            result1Checked = false; // not yet checked
-        }
-        if (stopAllStressTestersIfFail.load())
+        waitList.clear();
+        if (i == 0)
         {
-            std::lock_guard<std::mutex> l(stdOutputMutex);
-            *outStream << "#" << id << " Exiting, because some device failed." << std::endl;
-            handleOutput(id);
-            break;
+            waitList.push_back(bufferSet.resetEvent);
+            if (lastKernelEvent() != nullptr)
+                waitList.push_back(lastKernelEvent);
         }
-        if (stopAllStressTestersByUser.load())
+        else
+            waitList.push_back(execEvents[i-1]);
+        enqueueKernelChunk(clCmdQueue1, i - iter*kernelChunksNum, &waitList, &execEvents[i]);
+        if (launchesAfterWait == 0)
         {
-            std::lock_guard<std::mutex> l(stdOutputMutex);
-            *outStream << "#" << id << " Exiting, because user stopped test." << std::endl;
-            handleOutput(id);
-            break;
+            batchPrevEvent = (i != 0) ? execEvents[i-1] : lastKernelEvent;
+            batchFirstEvent = execEvents[i];
         }
-        
-        if (run2Exec)
-        {   /* after exec2 */
-            try
-            { exec2Events[passItersNum-1].wait(); }
-            catch(const cl::Error& err)
+        queuedLaunches.push_back(execEvents[i]);
+        if (++launchesAfterWait >= inFlightDepth)
+        {   /* launches of all buffer sets complete in order, caller waits for launch
+             * before last inFlightSlack launches to ensure fluent working */
+            launchesAfterWait = 0;
+            while (!queuedLaunches.empty() && isEventFinished(queuedLaunches.front()))
+                queuedLaunches.pop_front();
+            if (queuedLaunches.size() > inFlightSlack)
             {
-                if (err.err() != CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST)
-                    throw; // if other error
+                waitLaunchEvent = queuedLaunches[queuedLaunches.size()-1-inFlightSlack];
+                bufferSet.nextKernel = i+1;
+                return KERNELS_THROTTLED;
             }
-            run2Exec = false;
-            for (cxuint i = 0; i < passItersNum; i++)
-            {   // check kernel event status
-                int eventStatus;
-                exec2Events[i].getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS, &eventStatus);
-                if (eventStatus < 0)
-                {
-                    char strBuf[64];
-                    snprintf(strBuf, 64, "Failed NDRangeKernel with code: %d", eventStatus);
-                    throw MyException(strBuf);
-                }
-                exec2Events[i] = cl::Event(); // release event
+        }
+    }
+    lastKernelEvent = execEvents.back();
+    clCmdQueue1.flush();
+    enqueueResultsCheck(bufferSet);
+    return KERNELS_ENQUEUED;
+}
+
+void GPUStressTester::checkKernelEvent(const cl::Event& event)
+{
+    int eventStatus;
+    event.getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS, &eventStatus);
+    if (eventStatus < 0)
+    {
+        char strBuf[64];
+        snprintf(strBuf, 64, "Failed NDRangeKernel with code: %d", eventStatus);
+        throw MyException(strBuf);
+    }
+}
+
+bool GPUStressTester::executeBufferSet(BufferSet& bufferSet)
+{
+    beginBufferSet(bufferSet);
+    while (true)
+    {
+        const KernelsStatus status = enqueueKernels(bufferSet);
+        if (status == KERNELS_STOPPED)
+            return false;
+        if (status == KERNELS_ENQUEUED)
+            return true;
+        /* wait for ndrange kernel and ensure fluent working */
+        const cl::Event& event = waitLaunchEvent;
+        TraceSpan span(this, "wait kernel", &bufferSet.stageNanos[PASS_STAGE_KERNELS]);
+        try
+        {
+            if (!waitForEvent(event))
+            {   // stopped, remaining kernels are finished by finishTest
+                bufferSet.state = BUFSET_IDLE;
+                return false;
             }
-            // get results
-            if (!useInputAndOutput || (passItersNum&1) == 0)
-                clCmdQueue2.enqueueReadBuffer(clBuffer3, CL_TRUE, size_t(0), bufItemsNum<<2,
-                            results);
-            else //
-                clCmdQueue2.enqueueReadBuffer(clBuffer4, CL_TRUE, size_t(0), bufItemsNum<<2,
-                            results);
-            if (::memcmp(toCompare, results, bufItemsNum<<2))
-                throwFailedComputations(pass2Num);
-            printStatus(pass2Num);
-            pass2Num += 2;
-            result2Checked = true; // now is checked
         }
-        
-        if (stopAllStressTestersIfFail.load())
+        catch(const cl::Error& err)
         {
-            std::lock_guard<std::mutex> l(stdOutputMutex);
-            *outStream << "#" << id << " Exiting, because some device failed." << std::endl;
-            handleOutput(id);
-            break;
+            if (err.err() != CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST)
+                throw; // if other error
+            checkKernelEvent(event);
         }
-        if (stopAllStressTestersByUser.load())
+        updateInFlightDepth();
+    }
+}
+
+void GPUStressTester::updateInFlightDepth()
+{
+    const double maxQueuedNanos = getMaxQueuedNanos();
+    if (maxQueuedNanos == 0.0)
+        return;
+    const cl::Event& event = waitLaunchEvent;
+    cl_ulong startTime, endTime;
+    event.getProfilingInfo(CL_PROFILING_COMMAND_START, &startTime);
+    event.getProfilingInfo(CL_PROFILING_COMMAND_END, &endTime);
+    const double kernelTime = double(endTime-startTime);
+    avgKernelTime = (avgKernelTime != 0.0) ?
+            avgKernelTime + (kernelTime-avgKernelTime)*0.125 : kernelTime;
+    
+    /* idle gap: first kernel of awaited batch started later than its predecessor
+     * finished, because queue ran dry before host enqueued batch */
+    bool idleGap = false;
+    int firstStatus;
+    batchFirstEvent.getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS, &firstStatus);
+    if (batchPrevEvent() != nullptr && firstStatus == CL_COMPLETE)
+    {
+        cl_ulong prevEndTime, firstStartTime;
+        batchPrevEvent.getProfilingInfo(CL_PROFILING_COMMAND_END, &prevEndTime);
+        batchFirstEvent.getProfilingInfo(CL_PROFILING_COMMAND_START, &firstStartTime);
+        idleGap = firstStartTime > prevEndTime &&
+                double(firstStartTime-prevEndTime) > avgKernelTime*0.125;
+    }
+    
+    const cxuint maxKernels = std::max(cxuint(3), cxuint(std::min(1e6,
+                maxQueuedNanos / std::max(avgKernelTime, 1.0))));
+    if (idleGap)
+    {   // keep more kernels queued while host is waking up
+        inFlightSlack = std::min(inFlightSlack*2, maxKernels>>1);
+        gapFreeWaits = 0;
+    }
+    else if (++gapFreeWaits >= 32 && inFlightSlack > 1)
+    {
+        inFlightSlack--;
+        gapFreeWaits = 0;
+    }
+    /* maxKernels can drop below earlier slack (longer kernels),
+     * keep slack within half of maxKernels */
+    inFlightSlack = std::max(cxuint(1), std::min(inFlightSlack, maxKernels>>1));
+    // queued work (inFlightDepth+inFlightSlack kernels) must not exceed maxQueuedNanos
+    inFlightDepth = std::max(cxuint(2), maxKernels-inFlightSlack);
+}
+
+static const cl_uint zeroMismatches = 0;
+
+void GPUStressTester::enqueueResultsCheck(BufferSet& bufferSet)
+{
+    /* transfer queue waits for last kernel of the pass */
+    const std::vector<cl::Event> waitList(1, bufferSet.execEvents.back());
+    const cl::Buffer& outBuffer = getOutputBuffer(bufferSet);
+    if (verificationMode == VERIFY_HOST_COMPARE)
+        clCmdQueue2.enqueueReadBuffer(outBuffer, CL_FALSE, size_t(0), bufItemsNum<<2,
+                    bufferSet.results.data(), &waitList, &bufferSet.readEvent);
+    else if (verificationMode == VERIFY_DIGEST)
+        enqueueDigests(clCmdQueue2, outBuffer, bufferSet, &waitList, &bufferSet.readEvent);
+    else
+    {   /* compare on device, read back only the mismatch count and few indices */
+        std::vector<cl::Event> compareWaitList(2);
+        compareWaitList[0] = waitList[0];
+        clCmdQueue2.enqueueWriteBuffer(bufferSet.clMismatchBuffer, CL_FALSE, size_t(0),
+                    sizeof(cl_uint), &zeroMismatches, nullptr, &compareWaitList[1]);
+        clCompareKernel.setArg(2, outBuffer);
+        clCompareKernel.setArg(3, bufferSet.clMismatchBuffer);
+        std::vector<cl::Event> readWaitList(1);
+        clCmdQueue2.enqueueNDRangeKernel(clCompareKernel, cl::NDRange(0),
+                    cl::NDRange(workSize), cl::NullRange, &compareWaitList, &readWaitList[0]);
+        clCmdQueue2.enqueueReadBuffer(bufferSet.clMismatchBuffer, CL_FALSE, size_t(0),
+                    (maxReportedMismatches+1)<<2, bufferSet.mismatches.data(),
+                    &readWaitList, &bufferSet.readEvent);
+    }
+    bufferSet.state = BUFSET_READING;
+    clCmdQueue2.flush();
+}
+
+void GPUStressTester::checkResults(BufferSet& bufferSet)
+{
+    {
+        TraceSpan span(this, "wait results", &bufferSet.stageNanos[PASS_STAGE_READBACK]);
+        try
         {
-            std::lock_guard<std::mutex> l(stdOutputMutex);
-            *outStream << "#" << id << " Exiting, because user stopped test." << std::endl;
-            handleOutput(id);
-            break;
+            if (!waitForEvent(bufferSet.readEvent))
+                return; // stopped, results are checked by finishTest
         }
-        
-        clCmdQueue2.enqueueWriteBuffer(clBuffer3, CL_TRUE, size_t(0), bufItemsNum<<2,
-                initialValues);
-        /* run execution 2 */
-        if (!useInputAndOutput)
+        catch(const cl::Error& err)
         {
-            clKernel.setArg(1, clBuffer3);
-            clKernel.setArg(2, clBuffer3);
+            if (err.err() != CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST)
+                throw; // if other error
         }
-        
-        stepsAfterWait = 0;
-        allIsExecuted = true;
-        for (cxuint i = 0; i < passItersNum; i++)
+    }
+    if (traceFile != nullptr)
+        traceDeviceEvent("reset", TRACE_QUEUE1, bufferSet.resetEvent);
+    if (queue1Profiling)
+    {   /* upload stage: device time of reset instead of its enqueueing */
+        int eventStatus;
+        bufferSet.resetEvent.getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS, &eventStatus);
+        if (eventStatus == CL_COMPLETE)
         {
-            if (stopAllStressTestersIfFail.load() || stopAllStressTestersByUser.load())
-            {
-                allIsExecuted = false;
-                break;
-            }
-            if (useInputAndOutput)
-            {
-                if ((i&1) == 0)
-                {
-                    clKernel.setArg(1, clBuffer3);
-                    clKernel.setArg(2, clBuffer4);
-                }
-                else
-                {
-                    clKernel.setArg(1, clBuffer4);
-                    clKernel.setArg(2, clBuffer3);
-                }
-            }
-            clCmdQueue1.enqueueNDRangeKernel(clKernel, cl::NDRange(0),
-                    cl::NDRange(workSize), cl::NDRange(groupSize), nullptr, &exec2Events[i]);
-            stepsAfterWait++;
-            if (stepsAfterWait >= stepsPerWait && i+((stepsPerWait+1)>>1) < passItersNum)
-            {   /* wait for ndrange kernel and ensure fluent working */
-                stepsAfterWait = 0;
-                try
-                { exec2Events[i-1].wait(); }
-                catch(const cl::Error& err)
-                {
-                    if (err.err() != CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST)
-                        throw; // if other error
-                    int eventStatus;
-                    exec2Events[i-1].getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS, &eventStatus);
-                    if (eventStatus < 0)
-                    {
-                        char strBuf[64];
-                        snprintf(strBuf, 64, "Failed NDRangeKernel with code: %d", eventStatus);
-                        throw MyException(strBuf);
-                    }
-                }
-            }
+            cl_ulong eventStartTime, eventEndTime;
+            bufferSet.resetEvent.getProfilingInfo(CL_PROFILING_COMMAND_START,
+                        &eventStartTime);
+            bufferSet.resetEvent.getProfilingInfo(CL_PROFILING_COMMAND_END, &eventEndTime);
+            bufferSet.stageNanos[PASS_STAGE_UPLOAD] = eventEndTime-eventStartTime;
         }
-        if (allIsExecuted)
+    }
+    for (cl::Event& event: bufferSet.execEvents)
+    {   // check kernel event status
+        int eventStatus;
+        event.getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS, &eventStatus);
+        if (eventStatus < 0)
         {
-            run2Exec = true;
-            result2Checked = false; // not yet checked
+            char strBuf[64];
+            snprintf(strBuf, 64, "Failed NDRangeKernel with code: %d", eventStatus);
+            throw MyException(strBuf);
         }
-        if (stopAllStressTestersIfFail.load())
+        if (kernelSamplingPeriod != 0 && --kernelsToSample == 0)
         {
-            std::lock_guard<std::mutex> l(stdOutputMutex);
-            *outStream << "#" << id << " Exiting, because some device failed." << std::endl;
-            handleOutput(id);
-            break;
+            cl_ulong eventStartTime, eventEndTime;
+            event.getProfilingInfo(CL_PROFILING_COMMAND_START, &eventStartTime);
+            event.getProfilingInfo(CL_PROFILING_COMMAND_END, &eventEndTime);
+            kernelTimes.record(eventEndTime-eventStartTime);
+            kernelsToSample = kernelSamplingPeriod;
         }
-        if (stopAllStressTestersByUser.load())
+        if (traceFile != nullptr)
+            traceDeviceEvent("kernel", TRACE_QUEUE1, event);
+        event = cl::Event(); // release event
+    }
+    {
+        int eventStatus;
+        bufferSet.readEvent.getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS, &eventStatus);
+        if (eventStatus < 0)
         {
-            std::lock_guard<std::mutex> l(stdOutputMutex);
-            *outStream << "#" << id << " Exiting, because user stopped test." << std::endl;
-            handleOutput(id);
-            break;
+            char strBuf[64];
+            snprintf(strBuf, 64, "Failed reading results with code: %d", eventStatus);
+            throw MyException(strBuf);
         }
-        
-        if (run1Exec)
-        {   /* after exec1 */
-            try
-            { exec1Events[passItersNum-1].wait(); }
-            catch(const cl::Error& err)
+    }
+    if (traceFile != nullptr)
+        traceDeviceEvent("read", TRACE_QUEUE2, bufferSet.readEvent);
+    const std_time_point verifyStartTime = SteadyClock::now();
+    bufferSet.resetEvent = cl::Event();
+    bufferSet.readEvent = cl::Event();
+    
+    bufferSet.state = BUFSET_VERIFYING;
+    const cxuint passNum = bufferSet.passNum;
+    TraceSpan compareSpan(this, "compare", &bufferSet.stageNanos[PASS_STAGE_COMPARE]);
+    if (verificationMode == VERIFY_HOST_COMPARE)
+    {
+        CompareStats stats;
+        if (!compareResultsOnHost(comparePool, toCompare, bufferSet.results.data(),
+                    bufItemsNum, stats))
+        {
             {
-                if (err.err() != CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST)
-                    throw; // if other error
+                TesterLog log(id, true);
+                log << "#" << id << " Mismatched words: " << stats.mismatchesNum <<
+                        ", first: " << stats.firstMismatch <<
+                        ", last: " << stats.lastMismatch <<
+                        ", max ULP distance: " << stats.maxULPDistance << "\n  Bit flips:";
+                for (cxuint b = 0; b < 32; b++)
+                    if (stats.bitFlips[b] != 0)
+                        log << " " << b << ":" << stats.bitFlips[b];
+                log << std::endl;
             }
-            run1Exec = false;
-            for (cxuint i = 0; i < passItersNum; i++)
-            {   // check kernel event status
-                int eventStatus;
-                exec1Events[i].getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS, &eventStatus);
-                if (eventStatus < 0)
+            throwFailedComputations(passNum);
+        }
+    }
+    else if (verificationMode == VERIFY_DIGEST)
+    {
+        const std::vector<cl_ulong>& digests = bufferSet.digests;
+        if (::memcmp(goldenDigests.data(), digests.data(), digestsNum<<3))
+        {
+            size_t mismatchesNum = 0;
+            size_t firstMismatch = 0, lastMismatch = 0;
+            for (size_t i = 0; i < digestsNum; i++)
+                if (goldenDigests[i] != digests[i])
                 {
-                    char strBuf[64];
-                    snprintf(strBuf, 64, "Failed NDRangeKernel with code: %d", eventStatus);
-                    throw MyException(strBuf);
+                    if (mismatchesNum == 0)
+                        firstMismatch = i;
+                    lastMismatch = i;
+                    mismatchesNum++;
                 }
-                exec1Events[i] = cl::Event(); // release event
+            {
+                TesterLog log(id, true);
+                log << "#" << id << " Mismatched workgroup digests: " <<
+                        mismatchesNum << " of " << digestsNum <<
+                        ", first: " << firstMismatch <<
+                        ", last: " << lastMismatch << std::endl;
             }
-            // get results
-            if (!useInputAndOutput || (passItersNum&1) == 0)
-                clCmdQueue2.enqueueReadBuffer(clBuffer1, CL_TRUE, size_t(0), bufItemsNum<<2,
-                            results);
-            else //
-                clCmdQueue2.enqueueReadBuffer(clBuffer2, CL_TRUE, size_t(0), bufItemsNum<<2,
-                            results);
-            if (::memcmp(toCompare, results, bufItemsNum<<2))
-                throwFailedComputations(pass1Num);
-            printStatus(pass1Num);
-            pass1Num += 2;
-            result1Checked = true; // now is checked
+            throwFailedComputations(passNum);
         }
     }
+    else
+    {
+        cl_uint* mismatches = bufferSet.mismatches.data();
+        if (mismatches[0] != 0)
+        {
+            const cxuint reportedNum = std::min(mismatches[0],
+                        cl_uint(maxReportedMismatches));
+            std::sort(mismatches+1, mismatches+1+reportedNum);
+            {
+                TesterLog log(id, true);
+                log << "#" << id << " Mismatches: " << mismatches[0] <<
+                        ", at indices:";
+                for (cxuint i = 1; i <= reportedNum; i++)
+                    log << " " << mismatches[i];
+                if (reportedNum < mismatches[0])
+                    log << " ...";
+                log << std::endl;
+            }
+            throwFailedComputations(passNum);
+        }
     }
-    catch(...)
-    {   /* wait for finish kernels */
-        try
-        { clCmdQueue1.finish(); }
-        catch(...)
+    bufferSet.state = BUFSET_IDLE;
+    lastPassNum = passNum;
+    compareSpan.finish();
+    {
+        const std_time_point passEndTime = SteadyClock::now();
+        MetricsRecord record = makeMetricsRecord(METRICS_PASS);
+        record.verifyLatency = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    passEndTime-verifyStartTime).count()*1e-9;
+        const cl_ulong sampledCount = kernelTimes.getCount();
+        if (sampledCount != 0) // time of whole kernel (all its launches)
+            record.kernelTime = double(kernelTimes.getTimeSum())*kernelChunksNum /
+                    double(sampledCount)*1e-9;
+        // from time between verified passes
+        const cl_ulong passNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    passEndTime-lastPassTime).count();
+        if (passNanos != 0)
+            computeKernelPerf(usePolyWalker, kitersNum, bufItemsNum*passItersNum,
+                    passNanos, record.bandwidth, record.perf);
+        lastPassTime = passEndTime;
+        if (driftThreshold != 0 || driftSigma != 0)
+            updateDriftDetector(passNum, passNanos);
+        
+        passBandwidth.store(record.bandwidth, std::memory_order_relaxed);
+        passPerf.store(record.perf, std::memory_order_relaxed);
+        // moving average of last ~10 passes
+        const double alpha = (passNum > 1) ? 0.1 : 1.0;
+        rollingBandwidth.store(rollingBandwidth.load(std::memory_order_relaxed)*(1.0-alpha) +
+                    record.bandwidth*alpha, std::memory_order_relaxed);
+        rollingPerf.store(rollingPerf.load(std::memory_order_relaxed)*(1.0-alpha) +
+                    record.perf*alpha, std::memory_order_relaxed);
+        passesNum.store(passNum, std::memory_order_release);
+        
         {
-            std::lock_guard<std::mutex> l(stdOutputMutex);
-            *errStream << "Failed on CommandQueue1 finish" << std::endl;
-            handleOutput(id);
+            TraceSpan span(this, "logging", &bufferSet.stageNanos[PASS_STAGE_LOGGING]);
+            printStatus(passNum);
         }
-        try
-        { clCmdQueue2.finish(); }
-        catch(...)
+        for (cxuint s = 0; s < PASS_STAGES_NUM; s++)
         {
-            std::lock_guard<std::mutex> l(stdOutputMutex);
-            *errStream << "Failed on CommandQueue2 finish" << std::endl;
-            handleOutput(id);
+            const cl_ulong nanos = bufferSet.stageNanos[s];
+            stageTotalNanos[s] += nanos;
+            stageMaxNanos[s] = std::max(stageMaxNanos[s], nanos);
+            record.stageTimes[s] = double(nanos)*1e-9;
         }
-        throw;
+        emitMetricsRecord(record);
+    }
+}
+
+/* number of passes used to compute reference pass time ratio */
+static const cxuint driftWarmupPasses = 10;
+
+void GPUStressTester::updateDriftDetector(cxuint passNum, cl_ulong passNanos)
+{
+    if (calibKernelTime == 0 || passNanos == 0)
+        return;
+    DriftDetector& d = driftDetector;
+    // pass time relative to calibrated kernel time
+    const double ratio = double(passNanos) / (double(calibKernelTime)*passItersNum);
+    d.passesNum++;
+    if (d.passesNum == 1)
+        return; // first pass includes filling of pipeline
+    if (d.passesNum <= 1+driftWarmupPasses)
+    {   /* collect reference ratio and its variance */
+        d.mean += ratio;
+        d.variance += ratio*ratio;
+        if (d.passesNum == 1+driftWarmupPasses)
+        {
+            const double n = driftWarmupPasses;
+            d.baseline = d.mean = d.mean / n;
+            d.variance = std::max(0.0, (d.variance - n*d.mean*d.mean) / (n-1.0));
+        }
+        return;
+    }
+    
+    const double sigma = ::sqrt(d.variance);
+    if (driftSigma != 0 && sigma > 0.0 && ratio > d.mean + driftSigma*sigma)
+    {
+        char strBuf[128];
+        snprintf(strBuf, 128, "Pass time %.2f sigma above average (%.3fx kernel time)",
+                 (ratio-d.mean)/sigma, ratio);
+        reportDrift(passNum, strBuf);
     }
+    // exponentially weighted mean and variance
+    const double alpha = 0.1;
+    const double diff = ratio - d.mean;
+    d.mean += alpha*diff;
+    d.variance = (1.0-alpha)*(d.variance + alpha*diff*diff);
     
+    const double throughput = d.baseline / d.mean;
+    const bool degraded = (driftThreshold != 0 && throughput < 1.0-driftThreshold*0.01);
+    if (degraded)
+        d.degradedNanos += passNanos;
+    if (degraded != d.degraded)
+    {
+        char strBuf[128];
+        if (degraded)
+            snprintf(strBuf, 128, "Throughput dropped to %.1f%% (%.3fx kernel time)",
+                     throughput*100.0, d.mean);
+        else
+            snprintf(strBuf, 128, "Throughput recovered to %.1f%% (%.3fx kernel time)",
+                     throughput*100.0, d.mean);
+        reportDrift(passNum, strBuf);
+        d.degraded = degraded;
+    }
+}
+
+void GPUStressTester::reportDrift(cxuint passNum, const char* message)
+{
+    {
+        TesterLog log(id, true);
+        log << "#" << id << " " << platformName << ":" << deviceName <<
+                " WARNING at PASS #" << passNum << ": " << message << std::endl;
+    }
+    MetricsRecord record = makeMetricsRecord(METRICS_WARNING);
+    record.passNum = passNum;
+    record.message = message;
+    emitMetricsRecord(record);
+}
+
+void GPUStressTester::prepareTest()
+{
+    clKernel.setArg(0, cl_uint(workSize));
+    if (usePolyWalker)
+    {
+        clKernel.setArg(3, examplePoly[0]);
+        clKernel.setArg(4, examplePoly[1]);
+        clKernel.setArg(5, examplePoly[2]);
+        clKernel.setArg(6, examplePoly[3]);
+        clKernel.setArg(7, examplePoly[4]);
+    }
+    curSet = 0;
+    nextPassNum = 1;
+    lastKernelEvent = cl::Event();
+    kernelsToSample = kernelSamplingPeriod;
+    lastSampledCount = lastSampledTimeSum = 0;
+    inFlightSlack = 1;
+    inFlightDepth = stepsPerWait*kernelChunksNum; // in launches
+    if (getMaxQueuedNanos() != 0.0 && calibKernelTime != 0)
+        // with slack launches queued work doesn't exceed maxQueuedNanos
+        inFlightDepth = std::max(cxuint(2), std::min(inFlightDepth, std::max(cxuint(3),
+                    cxuint(getMaxQueuedNanos()*kernelChunksNum / double(calibKernelTime)))-
+                    inFlightSlack));
+    launchesAfterWait = 0;
+    queuedLaunches.clear();
+    waitLaunchEvent = batchFirstEvent = batchPrevEvent = cl::Event();
+    gapFreeWaits = 0;
+    avgKernelTime = 0.0;
+    driftDetector = DriftDetector();
+    std::fill(stageTotalNanos, stageTotalNanos+PASS_STAGES_NUM, 0);
+    std::fill(stageMaxNanos, stageMaxNanos+PASS_STAGES_NUM, 0);
+    startTime = RealtimeClock::now();
+    lastTime = lastPassTime = SteadyClock::now();
+    if (stopLatency != 0)
+    {
+        std::lock_guard<std::mutex> l(stopWaitersMutex);
+        stopWaiters.insert(this);
+    }
+}
+
+bool GPUStressTester::finishQueues()
+{
+    if (stopLatency != 0)
+    {   // no longer waits for events, reactor can be destroyed after finish
+        std::lock_guard<std::mutex> l(stopWaitersMutex);
+        stopWaiters.erase(this);
+    }
     bool queuesFinished = true;
-    /* finish all queues */
     try
     { clCmdQueue1.finish(); }
     catch(...)
     {
-        std::lock_guard<std::mutex> l(stdOutputMutex);
-        *errStream << "Failed on CommandQueue1 finish" << std::endl;
-        handleOutput(id);
+        TesterLog log(id, true);
+        log << "Failed on CommandQueue1 finish" << std::endl;
         queuesFinished = false;
     }
     try
     { clCmdQueue2.finish(); }
     catch(...)
     {
-        std::lock_guard<std::mutex> l(stdOutputMutex);
-        *errStream << "Failed on CommandQueue2 finish" << std::endl;
-        handleOutput(id);
+        TesterLog log(id, true);
+        log << "Failed on CommandQueue2 finish" << std::endl;
         queuesFinished = false;
     }
-    
-    if (!queuesFinished)
-        return; // if queues failed do not check (only returns)
-    
-    /* after break check kernel events and results */
+    if (stopLatency != 0)
+        reportStopLatency();
+    return queuesFinished;
+}
+
+void CL_CALLBACK GPUStressTester::waitEventCallback(cl_event event, cl_int status,
+                void* data)
+{
+    // callback owns its reference to wait state
+    std::shared_ptr<WaitState>* waitState = static_cast<std::shared_ptr<WaitState>*>(data);
     {
-        cxuint i;
-        for (i = 0; i < passItersNum; i++)
-        {   // check kernel event status
-            int eventStatus;
-            if (exec1Events[i]() == nullptr)
-                break; // no other events
-            exec1Events[i].getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS, &eventStatus);
-            if (eventStatus < 0)
-            {
-                char strBuf[64];
-                snprintf(strBuf, 64, "Failed NDRangeKernel with code: %d", eventStatus);
-                throw MyException(strBuf);
-            }
-        }
-        if (i == passItersNum && !result1Checked)
-        {   // get results
-            if (!useInputAndOutput || (passItersNum&1) == 0)
-                clCmdQueue2.enqueueReadBuffer(clBuffer1, CL_TRUE, size_t(0), bufItemsNum<<2,
-                            results);
-            else //
-                clCmdQueue2.enqueueReadBuffer(clBuffer2, CL_TRUE, size_t(0), bufItemsNum<<2,
-                            results);
-            if (::memcmp(toCompare, results, bufItemsNum<<2))
-                throwFailedComputations(pass1Num);
-            printStatus(pass1Num);
-        }
-        
-        for (i = 0; i < passItersNum; i++)
+        std::lock_guard<std::mutex> l((*waitState)->mutex);
+    }
+    (*waitState)->cond.notify_all();
+    delete waitState;
+}
+
+bool GPUStressTester::waitForEvent(const cl::Event& event)
+{
+    if (stopLatency == 0)
+    {
+        event.wait();
+        return true;
+    }
+    // commands must be submitted before waiting for callback
+    clCmdQueue1.flush();
+    clCmdQueue2.flush();
+    std::shared_ptr<WaitState>* callbackState = new std::shared_ptr<WaitState>(waitState);
+    try
+    { cl::Event(event).setCallback(CL_COMPLETE, waitEventCallback, callbackState); }
+    catch(...)
+    {
+        delete callbackState;
+        throw;
+    }
+    /* callback or stopAllStressTesters wakes up immediately,
+     * polling only for stop requested from signal handler */
+    const std::chrono::milliseconds pollTime(std::max(1, std::min(50, stopLatency/8)));
+    std::unique_lock<std::mutex> lock(waitState->mutex);
+    while (true)
+    {
+        cl_int eventStatus;
+        event.getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS, &eventStatus);
+        if (eventStatus == CL_COMPLETE)
+            return true;
+        if (eventStatus < 0) // same error as from clWaitForEvents
+            throw cl::Error(CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST, "clWaitForEvents");
+        if (stopAllStressTestersIfFail.load() || stopAllStressTestersByUser.load())
+            return false;
+        waitState->cond.wait_for(lock, pollTime);
+    }
+}
+
+void GPUStressTester::wakeUp()
+{
+    {
+        std::lock_guard<std::mutex> l(waitState->mutex);
+    }
+    waitState->cond.notify_all();
+    if (reactor != nullptr)
+        reactor->wakeUp();
+}
+
+void GPUStressTester::reportStopLatency()
+{
+    const int64_t requestTime = stopRequestTime.load();
+    if (requestTime == 0)
+        return;
+    const double latency = double(getSteadyNanos()-requestTime)*1e-6;
+    const bool exceeded = latency > double(stopLatency);
+    TesterLog log(id, exceeded);
+    log << "#" << id << " Quiesced in " << latency << " ms after stop request" <<
+            ((exceeded) ? " (EXCEEDED STOP LATENCY LIMIT!)" : "") << std::endl;
+}
+
+void GPUStressTester::finishTest()
+{
+    if (!finishQueues())
+        return; // if queues failed do not check (only returns)
+    
+    /* after break check kernel events and results */
+    std::vector<BufferSet*> pendingSets;
+    for (BufferSet& bufferSet: bufferSets)
+    {
+        for (const cl::Event& event: bufferSet.execEvents)
         {   // check kernel event status
-            int eventStatus;
-            if (exec2Events[i]() == nullptr)
+            if (event() == nullptr)
                 break; // no other events
-            exec2Events[i].getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS, &eventStatus);
-            if (eventStatus < 0)
-            {
-                char strBuf[64];
-                snprintf(strBuf, 64, "Failed NDRangeKernel with code: %d", eventStatus);
-                throw MyException(strBuf);
-            }
-        }
-        if (i == passItersNum && !result2Checked)
-        {   // get results
-            if (!useInputAndOutput || (passItersNum&1) == 0)
-                clCmdQueue2.enqueueReadBuffer(clBuffer3, CL_TRUE, size_t(0), bufItemsNum<<2,
-                            results);
-            else //
-                clCmdQueue2.enqueueReadBuffer(clBuffer4, CL_TRUE, size_t(0), bufItemsNum<<2,
-                            results);
-            if (::memcmp(toCompare, results, bufItemsNum<<2))
-                throwFailedComputations(pass2Num);
-            printStatus(pass2Num);
+            checkKernelEvent(event);
         }
+        if (bufferSet.state == BUFSET_READING)
+            pendingSets.push_back(&bufferSet);
     }
+    // get results in pass order
+    std::sort(pendingSets.begin(), pendingSets.end(),
+              [](const BufferSet* a, const BufferSet* b)
+              { return a->passNum < b->passNum; });
+    for (BufferSet* bufferSet: pendingSets)
+        checkResults(*bufferSet);
 }
-catch(const cl::Error& error)
+
+void GPUStressTester::reportFailure()
 {
     failed = true;
     try
+    { throw; }
+    catch(const cl::Error& error)
     {
-        char codeBuf[64];
-        snprintf(codeBuf, 64, ", Code: %d", error.err());
-        failMessage = "OpenCL error happened: ";
-        failMessage += error.what();
-        failMessage += codeBuf;
-        std::lock_guard<std::mutex> l(stdOutputMutex);
-        *errStream << "Failed StressTester for\n  " <<
-                "#" << id  << " " << platformName << ":" << deviceName << ": " <<
-                failMessage << std::endl;
-        handleOutput(id);
+        try
+        {
+            char codeBuf[64];
+            snprintf(codeBuf, 64, ", Code: %d", error.err());
+            failMessage = "OpenCL error happened: ";
+            failMessage += error.what();
+            failMessage += codeBuf;
+            TesterLog log(id, true);
+            log << "Failed StressTester for\n  " <<
+                    "#" << id  << " " << platformName << ":" << deviceName << ": " <<
+                    failMessage << std::endl;
+        }
+        catch(...)
+        {
+            std::lock_guard<std::mutex> l(stdOutputMutex);
+            *errStream << "Can't print fatal error!!!" << std::endl;
+            handleOutput(id);
+        } // fatal exception!!!
+    }
+    catch(const std::exception& ex)
+    {
+        try
+        {
+            failMessage = "Exception happened: ";
+            failMessage += ex.what();
+            TesterLog log(id, true);
+            log << "Failed StressTester for\n  " <<
+                    "#" << id << " " << platformName << ":" << deviceName << ":\n    " <<
+                    failMessage << std::endl;
+        }
+        catch(...)
+        {
+            std::lock_guard<std::mutex> l(stdOutputMutex);
+            *errStream << "Can't print fatal error!!!" << std::endl;
+            handleOutput(id);
+        } // fatal exception!!!
     }
     catch(...)
     {
-        std::lock_guard<std::mutex> l(stdOutputMutex);
-        *errStream << "Can't print fatal error!!!" << std::endl;
-        handleOutput(id);
-    } // fatal exception!!!
+        try
+        {
+            failMessage = "Unknown exception happened";
+            TesterLog log(id, true);
+            log << "Failed StressTester for\n  " <<
+                    "#" << id << " " << platformName << ":" << deviceName << ":\n    " <<
+                    failMessage << std::endl;
+        }
+        catch(...)
+        {
+            std::lock_guard<std::mutex> l(stdOutputMutex);
+            *errStream << "Can't print fatal error!!!" << std::endl;
+            handleOutput(id);
+        } // fatal exception!!!
+    }
+    
+    MetricsRecord record = makeMetricsRecord(METRICS_FAILURE);
+    record.passNum = lastPassNum+1; // pass which is verified or executed
+    record.message = failMessage.c_str();
+    emitMetricsRecord(record);
 }
-catch(const std::exception& ex)
+
+GPUStressLiveStats GPUStressTester::getLiveStats() const
 {
-    failed = true;
+    GPUStressLiveStats stats;
+    stats.passesNum = passesNum.load(std::memory_order_acquire);
+    stats.bandwidth = passBandwidth.load(std::memory_order_relaxed);
+    stats.perf = passPerf.load(std::memory_order_relaxed);
+    stats.rollingBandwidth = rollingBandwidth.load(std::memory_order_relaxed);
+    stats.rollingPerf = rollingPerf.load(std::memory_order_relaxed);
+    return stats;
+}
+
+MetricsRecord GPUStressTester::makeMetricsRecord(MetricsRecordType type) const
+{
+    MetricsRecord record;
+    record.type = type;
+    record.id = id;
+    record.passNum = lastPassNum;
+    record.kernelTime = double(calibKernelTime)*1e-9;
+    record.bandwidth = record.perf = 0.0;
+    record.elapsedTime = (type != METRICS_CALIBRATION) ?
+            std::max(int64_t(0), std::chrono::duration_cast<std::chrono::milliseconds>(
+                RealtimeClock::now()-startTime).count())*1e-3 : 0.0;
+    record.verifyLatency = 0.0;
+    record.degradedTime = 0.0;
+    std::fill(record.stageTimes, record.stageTimes+PASS_STAGES_NUM, 0.0);
+    record.message = nullptr;
+    return record;
+}
+
+static const char* passStageNames[PASS_STAGES_NUM] =
+{ "upload", "kernels", "readback", "compare", "logging" };
+
+void GPUStressTester::printStageSummary()
+{
+    cl_ulong allNanos = 0;
+    for (cxuint s = 0; s < PASS_STAGES_NUM; s++)
+        allNanos += stageTotalNanos[s];
+    TesterLog log(id);
+    log << "#" << id << " " << platformName << ":" << deviceName <<
+            " pass stages (" << lastPassNum << " passes):\n"
+            "  stage        total[s]     avg[ms]     max[ms]  share" << std::endl;
+    for (cxuint s = 0; s < PASS_STAGES_NUM; s++)
+    {
+        char lineBuf[128];
+        snprintf(lineBuf, 128, "  %-8s %12.3f %11.3f %11.3f %5.1f%%", passStageNames[s],
+                 double(stageTotalNanos[s])*1e-9,
+                 double(stageTotalNanos[s])*1e-6/lastPassNum,
+                 double(stageMaxNanos[s])*1e-6,
+                 (allNanos != 0) ? double(stageTotalNanos[s])*100.0/double(allNanos) : 0.0);
+        log << lineBuf << "\n";
+    }
+}
+
+void GPUStressTester::emitExitRecord()
+{
+    MetricsRecord record = makeMetricsRecord(METRICS_EXIT);
+    if (record.elapsedTime > 0.0 && lastPassNum != 0)
+        // average from whole test
+        computeKernelPerf(usePolyWalker, kitersNum,
+                double(bufItemsNum)*double(passItersNum)*double(lastPassNum),
+                cl_ulong(record.elapsedTime*1e9),
+                record.bandwidth, record.perf);
+    if (failed)
+        record.message = failMessage.c_str();
+    for (cxuint s = 0; s < PASS_STAGES_NUM; s++)
+        record.stageTimes[s] = double(stageTotalNanos[s])*1e-9;
+    if (lastPassNum != 0)
+        printStageSummary();
+    if (driftThreshold != 0)
+    {
+        record.degradedTime = double(driftDetector.degradedNanos)*1e-9;
+        TesterLog log(id);
+        log << "#" << id << " " << platformName << ":" << deviceName <<
+                " time in degraded state: " << record.degradedTime << "s of " <<
+                record.elapsedTime << "s" << std::endl;
+    }
+    emitMetricsRecord(record);
+}
+
+void GPUStressTester::runTest()
+try
+{
+    prepareTest();
+    const cxuint setsNum = bufferSets.size();
     try
     {
-        failMessage = "Exception happened: ";
-        failMessage += ex.what();
-        std::lock_guard<std::mutex> l(stdOutputMutex);
-        *errStream << "Failed StressTester for\n  " <<
-                "#" << id << " " << platformName << ":" << deviceName << ":\n    " <<
-                failMessage << std::endl;
-        handleOutput(id);
+    /* ring of buffer sets: while oldest pass is verified, newer passes are executed */
+    while (true)
+    {
+        if (checkExitRequest())
+            break;
+        
+        if (!executeBufferSet(bufferSets[curSet]))
+        {
+            checkExitRequest();
+            break;
+        }
+        curSet = (curSet+1) % setsNum;
+        
+        BufferSet& oldestSet = bufferSets[curSet];
+        if (oldestSet.state == BUFSET_READING)
+            checkResults(oldestSet);
+    }
     }
     catch(...)
-    {
-        std::lock_guard<std::mutex> l(stdOutputMutex);
-        *errStream << "Can't print fatal error!!!" << std::endl;
-        handleOutput(id);
-    } // fatal exception!!!
+    {   /* wait for finish kernels */
+        finishQueues();
+        throw;
+    }
+    finishTest();
+    emitExitRecord();
 }
 catch(...)
 {
-    failed = true;
+    reportFailure();
+    emitExitRecord();
+}
+
+/*
+ * asynchronous execution: instead of blocking on events, tester registers
+ * callback on awaited event and returns to reactor
+ */
+
+void CL_CALLBACK GPUStressTester::asyncEventCallback(cl_event event, cl_int status,
+                void* data)
+{
+    GPUStressTester* tester = static_cast<GPUStressTester*>(data);
+    tester->reactor->notify(tester);
+}
+
+bool GPUStressTester::stepAsync()
+{
+    const cxuint setsNum = bufferSets.size();
+    while (true)
+    {
+        BufferSet& bufferSet = bufferSets[curSet];
+        if (asyncWait == ASYNC_KERNEL)
+        {
+            if (!isEventFinished(waitLaunchEvent))
+            {   // woken up by stop request, remaining kernels are finished by finishTest
+                bufferSet.state = BUFSET_IDLE;
+                checkExitRequest();
+                return false;
+            }
+            checkKernelEvent(waitLaunchEvent);
+            updateInFlightDepth();
+        }
+        else if (asyncWait == ASYNC_RESULTS)
+            checkResults(bufferSet);
+        asyncWait = ASYNC_NONE;
+        
+        if (checkExitRequest())
+            return false;
+        
+        if (bufferSet.state == BUFSET_IDLE)
+            beginBufferSet(bufferSet);
+        const KernelsStatus status = enqueueKernels(bufferSet);
+        if (status == KERNELS_STOPPED)
+        {
+            checkExitRequest();
+            return false;
+        }
+        if (status == KERNELS_THROTTLED)
+        {
+            asyncWait = ASYNC_KERNEL;
+            clCmdQueue1.flush();
+            waitLaunchEvent.setCallback(CL_COMPLETE, asyncEventCallback, this);
+            return true;
+        }
+        curSet = (curSet+1) % setsNum;
+        
+        BufferSet& oldestSet = bufferSets[curSet];
+        if (oldestSet.state == BUFSET_READING)
+        {
+            asyncWait = ASYNC_RESULTS;
+            oldestSet.readEvent.setCallback(CL_COMPLETE, asyncEventCallback, this);
+            return true;
+        }
+    }
+}
+
+bool GPUStressTester::startAsync(GPUStressReactor* thisReactor)
+{
+    reactor = thisReactor;
+    asyncWait = ASYNC_NONE;
     try
+    { prepareTest(); }
+    catch(...)
     {
-        failMessage = "Unknown exception happened";
-        std::lock_guard<std::mutex> l(stdOutputMutex);
-        *errStream << "Failed StressTester for\n  " <<
-                "#" << id << " " << platformName << ":" << deviceName << ":\n    " <<
-                failMessage << std::endl;
-        handleOutput(id);
+        reportFailure();
+        emitExitRecord();
+        return false;
+    }
+    return resumeAsync();
+}
+
+bool GPUStressTester::resumeAsync()
+{
+    try
+    {
+        try
+        {
+            if (stepAsync())
+                return true; // waits for next event
+        }
+        catch(...)
+        {   /* wait for finish kernels */
+            finishQueues();
+            throw;
+        }
+        finishTest();
     }
     catch(...)
+    { reportFailure(); }
+    emitExitRecord();
+    return false;
+}
+
+/*
+ * autotuner of groupSize, workFactor, blocksNum and kitersNum
+ */
+
+static const cxuint autotuneGroupSizes[6] = { 32, 64, 128, 256, 512, 1024 };
+static const cxuint autotuneWorkFactors[6] = { 32, 64, 128, 256, 512, 1024 };
+static const cxuint autotuneMaxBlocksNum = 8;
+static const char* autotuneObjectiveNames[4] =
+{ "performance", "bandwidth", "product", "kernel time" };
+
+static double getAutotuneObjective(cl_ulong kernelTime, double bandwidth, double perf)
+{
+    switch (autotuneObjective)
+    {
+        case AUTOTUNE_PERF:
+            return perf;
+        case AUTOTUNE_BANDWIDTH:
+            return bandwidth;
+        case AUTOTUNE_PRODUCT:
+            return bandwidth*perf;
+        default: // longest kernel under time cap
+            return double(kernelTime);
+    }
+}
+
+GPUStressConfig autotuneGPUStressConfig(cxuint id, cl::Device& clDevice,
+            const GPUStressConfig& config)
+{
+    cl::Platform clPlatform;
+    clDevice.getInfo(CL_DEVICE_PLATFORM, &clPlatform);
+    std::string platformName, deviceName;
+    clPlatform.getInfo(CL_PLATFORM_NAME, &platformName);
+    platformName = trimSpaces(platformName);
+    clDevice.getInfo(CL_DEVICE_NAME, &deviceName);
+    deviceName = trimSpaces(deviceName);
+    
+    size_t maxGroupSize;
+    cl_uint maxComputeUnits;
+    cl_ulong maxAllocSize, globalMemSize;
+    clDevice.getInfo(CL_DEVICE_MAX_WORK_GROUP_SIZE, &maxGroupSize);
+    clDevice.getInfo(CL_DEVICE_MAX_COMPUTE_UNITS, &maxComputeUnits);
+    clDevice.getInfo(CL_DEVICE_MAX_MEM_ALLOC_SIZE, &maxAllocSize);
+    clDevice.getInfo(CL_DEVICE_GLOBAL_MEM_SIZE, &globalMemSize);
+    
+    const bool polyWalker = (config.builtinKernel >= 2);
+    const char* kernelSource = getBuiltinKernelSource(config.builtinKernel);
+    const cxuint itersArgIndex = (polyWalker) ? 8 : 3;
+    // exploit step doesn't go beyond largest probed or given workFactor
+    const cxuint maxWorkFactor = std::max(config.workFactor, autotuneWorkFactors[5]);
+    
+    cl_context_properties clContextProps[3];
+    clContextProps[0] = CL_CONTEXT_PLATFORM;
+    clContextProps[1] = reinterpret_cast<cl_context_properties>(clPlatform());
+    clContextProps[2] = 0;
+    cl::Context clContext(clDevice, clContextProps);
+    cl::CommandQueue profCmdQueue(clContext, clDevice, CL_QUEUE_PROFILING_ENABLE);
+    
+    std::vector<cxuint> groupSizes;
+    for (cxuint groupSize: autotuneGroupSizes)
+        if (groupSize <= maxGroupSize)
+            groupSizes.push_back(groupSize);
+    if (groupSizes.empty())
+        groupSizes.push_back(maxGroupSize);
+    
     {
         std::lock_guard<std::mutex> l(stdOutputMutex);
-        *errStream << "Can't print fatal error!!!" << std::endl;
+        *outStream << "Autotuning for\n  " <<
+                "#" << id << " " << platformName << ":" << deviceName <<
+                "\n    objective: " << autotuneObjectiveNames[autotuneObjective] <<
+                ", budget: " << autotuneBudget << "s" << std::endl;
+        handleOutput(id);
+    }
+    
+    // kernels with runtime kitersNum and blocksNum for every groupSize
+    std::map<cxuint, cl::Kernel> kernels;
+    auto getKernel = [&](cxuint groupSize) -> cl::Kernel
+    {
+        auto it = kernels.find(groupSize);
+        if (it != kernels.end())
+            return it->second;
+        cl::Program::Sources clSources;
+        clSources.push_back(std::make_pair(clKernelItersSource,
+                    ::strlen(clKernelItersSource)));
+        clSources.push_back(std::make_pair(kernelSource, ::strlen(kernelSource)));
+        cl::Program clProgram(clContext, clSources);
+        char buildOptions[64];
+        snprintf(buildOptions, 64, "-DGROUPSIZE=%uU -DRUNTIME_ITERS", groupSize);
+        cl::Kernel kernel;
+        try
+        {
+            clProgram.build(buildOptions);
+            kernel = cl::Kernel(clProgram, "gpuStress");
+            size_t kernelGroupSize;
+            kernel.getWorkGroupInfo(clDevice, CL_KERNEL_WORK_GROUP_SIZE, &kernelGroupSize);
+            if (groupSize > kernelGroupSize)
+                kernel = cl::Kernel(); // this groupSize can't be used
+        }
+        catch(const cl::Error&)
+        { kernel = cl::Kernel(); }
+        kernels[groupSize] = kernel;
+        return kernel;
+    };
+    
+    std::mt19937 random(id);
+    std::vector<float> initialValues;
+    // groupSize, workFactor, blocksNum and kitersNum of probed samples
+    std::set<std::tuple<cxuint, cxuint, cxuint, cxuint> > probedSamples;
+    GPUStressConfig bestConfig = config;
+    double bestObjective = -1.0;
+    cl_ulong bestKernelTime = 0;
+    double bestBandwidth = 0.0, bestPerf = 0.0;
+    cxuint probesNum = 0;
+    const SteadyClock::time_point startTime = SteadyClock::now();
+    
+    for (cxuint attempt = 0; attempt < 10000; attempt++)
+    {
+        if (stopAllStressTestersByUser.load())
+            return config;
+        if (std::chrono::duration_cast<std::chrono::milliseconds>(
+                SteadyClock::now()-startTime).count() >= autotuneBudget*1000LL)
+            break;
+        
+        GPUStressConfig sample = config;
+        if (attempt == 0)
+        {   // start from given config
+            sample.groupSize = (config.groupSize != 0) ? config.groupSize : groupSizes.back();
+            if (sample.kitersNum == 0)
+                sample.kitersNum = 1 + random()%40;
+        }
+        else if ((attempt&1) != 0 && bestObjective >= 0.0)
+        {   /* exploit: move one parameter of best config to neighbour value */
+            sample = bestConfig;
+            const int dir = (random()&1) ? 1 : -1;
+            switch (random()%4)
+            {
+                case 0:
+                    sample.groupSize = (dir > 0) ? sample.groupSize<<1 :
+                            std::max(sample.groupSize>>1, 1U);
+                    break;
+                case 1:
+                    sample.workFactor = (dir > 0) ? sample.workFactor<<1 :
+                            std::max(sample.workFactor>>1, 1U);
+                    break;
+                case 2:
+                    sample.blocksNum = std::max(int(sample.blocksNum)+dir, 1);
+                    break;
+                default:
+                    sample.kitersNum = std::max(int(sample.kitersNum)+dir*int(1+random()%3), 1);
+                    break;
+            }
+        }
+        else
+        {   /* explore: random point */
+            sample.groupSize = groupSizes[random()%groupSizes.size()];
+            sample.workFactor = autotuneWorkFactors[random()%6];
+            sample.blocksNum = 1 + random()%autotuneMaxBlocksNum;
+            sample.kitersNum = 1 + random()%40;
+        }
+        if (sample.groupSize > maxGroupSize || sample.kitersNum > 40 ||
+            sample.blocksNum > autotuneMaxBlocksNum || sample.workFactor > maxWorkFactor)
+            continue;
+        
+        if (!probedSamples.insert(std::make_tuple(cxuint(sample.groupSize),
+                    sample.workFactor, sample.blocksNum, sample.kitersNum)).second)
+            continue; // already probed
+        
+        const size_t workSize = size_t(maxComputeUnits)*sample.groupSize*sample.workFactor;
+        const size_t itemsNum = (workSize<<4)*sample.blocksNum;
+        const cl_ulong bufSize = cl_ulong(itemsNum)<<2;
+        // buffers of all sets, pristine copy and golden results
+        const cl_ulong totalSize = bufSize*(cl_ulong(pipelineDepth)*
+                (config.inputAndOutput ? 2 : 1) + 2);
+        if (bufSize > maxAllocSize || totalSize > globalMemSize)
+            continue; // doesn't fit to memory
+        
+        cl::Kernel kernel = getKernel(sample.groupSize);
+        if (kernel() == nullptr)
+            continue;
+        
+        if (initialValues.size() < itemsNum)
+        {
+            initialValues.resize(itemsNum);
+            generateInitialValues(initialValues.data(), itemsNum, polyWalker);
+        }
+        cl_ulong kernelTime;
+        double kernelNoise;
+        try
+        {
+            cl::Buffer initBuffer(clContext, CL_MEM_READ_ONLY, bufSize);
+            cl::Buffer buffer1(clContext, CL_MEM_READ_WRITE, bufSize);
+            cl::Buffer buffer2;
+            if (config.inputAndOutput)
+                buffer2 = cl::Buffer(clContext, CL_MEM_READ_WRITE, bufSize);
+            profCmdQueue.enqueueWriteBuffer(initBuffer, CL_TRUE, size_t(0), bufSize,
+                        initialValues.data());
+        
+            kernel.setArg(0, cl_uint(workSize));
+            kernel.setArg(1, buffer1);
+            kernel.setArg(2, config.inputAndOutput ? buffer2 : buffer1);
+            if (polyWalker)
+                for (cxuint k = 0; k < 5; k++)
+                    kernel.setArg(3+k, examplePoly[k]);
+            kernel.setArg(itersArgIndex, cl_uint(sample.kitersNum));
+            kernel.setArg(itersArgIndex+1, cl_uint(sample.blocksNum));
+        
+            auto runSample = [&]() -> cl_ulong
+            {   // every run on same input
+                profCmdQueue.enqueueCopyBuffer(initBuffer, buffer1, size_t(0), size_t(0),
+                            bufSize);
+                cl::Event profEvent;
+                profCmdQueue.enqueueNDRangeKernel(kernel, cl::NDRange(0),
+                        cl::NDRange(workSize), cl::NDRange(sample.groupSize), nullptr,
+                        &profEvent);
+                profEvent.wait();
+                cl_ulong eventStartTime, eventEndTime;
+                profEvent.getProfilingInfo(CL_PROFILING_COMMAND_START, &eventStartTime);
+                profEvent.getProfilingInfo(CL_PROFILING_COMMAND_END, &eventEndTime);
+                return eventEndTime-eventStartTime;
+            };
+            if (!measureTiming(runSample, timingSamples, kernelTime, kernelNoise))
+                return config; // if stopped by user
+        }
+        catch(const cl::Error&)
+        { continue; } // probe failed (out of resources or memory), skip this sample
+        probesNum++;
+        if (kernelTime == 0 || (autotuneTimeCap != 0 &&
+                kernelTime > cl_ulong(autotuneTimeCap)*1000000ULL))
+            continue; // exceeds time cap
+        
+        double bandwidth, perf;
+        computeKernelPerf(polyWalker, sample.kitersNum, itemsNum, kernelTime, bandwidth, perf);
+        const double objective = getAutotuneObjective(kernelTime, bandwidth, perf);
+        if (objective > bestObjective)
+        {
+            bestObjective = objective;
+            bestConfig = sample;
+            bestKernelTime = kernelTime;
+            bestBandwidth = bandwidth;
+            bestPerf = perf;
+        }
+    }
+    
+    std::lock_guard<std::mutex> l(stdOutputMutex);
+    if (bestObjective < 0.0)
+    {
+        *outStream << "#" << id << " Autotuning didn't find any config, "
+                "using given config." << std::endl;
         handleOutput(id);
-    } // fatal exception!!!
+        return config;
+    }
+    *outStream << "Autotuned config for\n  " <<
+            "#" << id << " " << platformName << ":" << deviceName <<
+            "\n    groupSize=" << bestConfig.groupSize <<
+            ", workFactor=" << bestConfig.workFactor <<
+            ", blocksNum=" << bestConfig.blocksNum <<
+            ", kitersNum=" << bestConfig.kitersNum <<
+            "\n    KernelTime: " << (double(bestKernelTime)*1e-9) <<
+            "s, Bandwidth: " << bestBandwidth << " GB/s, Performance: " << bestPerf <<
+            " GFLOPS, probes: " << probesNum << std::endl;
+    handleOutput(id);
+    return bestConfig;
+}
+
+std::vector<GPUStressTester*> createGPUStressTesters(std::vector<cl::Device>& clDevices,
+            const std::vector<GPUStressConfig>& configs)
+{
+    const size_t devicesNum = clDevices.size();
+    traceBaseTime = SteadyClock::now();
+    compareTestersNum = std::max(size_t(1), devicesNum);
+    std::vector<cl::Context> sharedContexts(devicesNum);
+    if (useSharedPrograms)
+    {   /* identical devices from same platform share one context and programs */
+        std::vector<bool> grouped(devicesNum, false);
+        for (size_t i = 0; i < devicesNum; i++)
+        {
+            if (grouped[i])
+                continue;
+            const cl_platform_id platform = clDevices[i].getInfo<CL_DEVICE_PLATFORM>();
+            const std::string deviceName = clDevices[i].getInfo<CL_DEVICE_NAME>();
+            std::vector<size_t> group;
+            std::vector<cl::Device> groupDevices;
+            for (size_t j = i; j < devicesNum; j++)
+                if (!grouped[j] && clDevices[j].getInfo<CL_DEVICE_PLATFORM>() == platform &&
+                    clDevices[j].getInfo<CL_DEVICE_NAME>() == deviceName)
+                {
+                    grouped[j] = true;
+                    group.push_back(j);
+                    groupDevices.push_back(clDevices[j]);
+                }
+            if (group.size() < 2)
+                continue; // nothing to share
+            cl_context_properties clContextProps[3];
+            clContextProps[0] = CL_CONTEXT_PLATFORM;
+            clContextProps[1] = reinterpret_cast<cl_context_properties>(platform);
+            clContextProps[2] = 0;
+            const cl::Context clContext(groupDevices, clContextProps);
+            for (size_t j: group)
+                sharedContexts[j] = clContext;
+        }
+    }
+    
+    std::vector<GPUStressTester*> testers(devicesNum, nullptr);
+    std::vector<std::exception_ptr> exceptions(devicesNum);
+    std::vector<std::thread> initThreads;
+    /* initialize all devices concurrently */
+    for (size_t i = 0; i < devicesNum; i++)
+        initThreads.push_back(std::thread(
+                [&clDevices,&configs,&sharedContexts,&testers,&exceptions,i]()
+        {
+            try
+            {
+                GPUStressConfig config = configs[i];
+                if (autotuneBudget != 0)
+                    config = autotuneGPUStressConfig(i, clDevices[i], config);
+                const cl::Context* sharedContext = (sharedContexts[i]() != nullptr) ?
+                        &sharedContexts[i] : nullptr;
+                testers[i] = new GPUStressTester(i, clDevices[i], config, sharedContext);
+            }
+            catch(...)
+            { exceptions[i] = std::current_exception(); }
+        }));
+    for (std::thread& thread: initThreads)
+        thread.join();
+    
+    bool allInitialized = true;
+    for (GPUStressTester* tester: testers)
+        if (tester == nullptr || !tester->isInitialized())
+            allInitialized = false;
+    if (allInitialized)
+        return testers;
+    
+    for (GPUStressTester* tester: testers)
+        delete tester;
+    for (const std::exception_ptr& exception: exceptions)
+        if (exception)
+            std::rethrow_exception(exception);
+    return std::vector<GPUStressTester*>(); // if user stopped initialization
+}
+
+void GPUStressReactor::notify(GPUStressTester* tester)
+{
+    std::lock_guard<std::mutex> l(mutex);
+    readyTesters.push_back(tester);
+    cond.notify_one();
+}
+
+void GPUStressReactor::wakeUp()
+{
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        stopRequested = true;
+    }
+    cond.notify_one();
+}
+
+void GPUStressReactor::run(const std::vector<GPUStressTester*>& testers)
+{
+    std::set<GPUStressTester*> activeTesters;
+    for (GPUStressTester* tester: testers)
+        if (tester->startAsync(this))
+            activeTesters.insert(tester);
+    
+    /* every active tester waits for exactly one event callback, testers finished
+     * by stop request still wait for callbacks of their events */
+    std::set<GPUStressTester*> stoppedTesters;
+    bool stopHandled = false;
+    const std::chrono::milliseconds pollTime(std::max(1, std::min(50, stopLatency/8)));
+    while (!activeTesters.empty() || !stoppedTesters.empty())
+    {
+        GPUStressTester* tester = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (stopLatency == 0 || stopHandled)
+                cond.wait(lock, [this] { return !readyTesters.empty(); });
+            else // polling only for stop requested from signal handler
+                cond.wait_for(lock, pollTime,
+                        [this] { return !readyTesters.empty() || stopRequested; });
+            if (!readyTesters.empty())
+            {
+                tester = readyTesters.front();
+                readyTesters.pop_front();
+            }
+        }
+        if (tester != nullptr)
+        {
+            if (stoppedTesters.erase(tester) == 0 && !tester->resumeAsync())
+                activeTesters.erase(tester);
+        }
+        else if (stopAllStressTestersIfFail.load() || stopAllStressTestersByUser.load())
+        {   /* resume testers without waiting for their events,
+             * they finish their commands and exit */
+            stopHandled = true;
+            for (GPUStressTester* activeTester: activeTesters)
+            {
+                activeTester->resumeAsync();
+                stoppedTesters.insert(activeTester);
+            }
+            activeTesters.clear();
+        }
+    }
+}
+
+/*
+ * metrics server
+ */
+
+GPUStressMetricsServer::GPUStressMetricsServer() : listenFd(-1), stopRequest(false)
+{ }
+
+GPUStressMetricsServer::~GPUStressMetricsServer()
+{
+    stop();
+}
+
+std::string GPUStressMetricsServer::getOpenMetrics() const
+{
+    std::ostringstream oss;
+    oss << "# TYPE gpustress_passes counter\n"
+        "# HELP gpustress_passes Verified passes.\n";
+    for (const GPUStressTester* tester: testers)
+        oss << "gpustress_passes_total" << getLabels(tester) << " " <<
+                tester->getLiveStats().passesNum << "\n";
+    oss << "# TYPE gpustress_failed gauge\n"
+        "# HELP gpustress_failed 1 if tester failed.\n";
+    for (const GPUStressTester* tester: testers)
+        oss << "gpustress_failed" << getLabels(tester) << " " <<
+                (tester->isFailed() ? 1 : 0) << "\n";
+    oss << "# TYPE gpustress_bandwidth_gbps gauge\n"
+        "# HELP gpustress_bandwidth_gbps Bandwidth in GB/s of last pass and rolling average.\n";
+    for (const GPUStressTester* tester: testers)
+    {
+        const GPUStressLiveStats stats = tester->getLiveStats();
+        oss << "gpustress_bandwidth_gbps" << getLabels(tester, "window=\"pass\"") << " " <<
+                stats.bandwidth << "\n"
+            "gpustress_bandwidth_gbps" << getLabels(tester, "window=\"rolling\"") << " " <<
+                stats.rollingBandwidth << "\n";
+    }
+    oss << "# TYPE gpustress_perf_gflops gauge\n"
+        "# HELP gpustress_perf_gflops Performance in GFLOPS of last pass and rolling average.\n";
+    for (const GPUStressTester* tester: testers)
+    {
+        const GPUStressLiveStats stats = tester->getLiveStats();
+        oss << "gpustress_perf_gflops" << getLabels(tester, "window=\"pass\"") << " " <<
+                stats.perf << "\n"
+            "gpustress_perf_gflops" << getLabels(tester, "window=\"rolling\"") << " " <<
+                stats.rollingPerf << "\n";
+    }
+    oss << "# TYPE gpustress_kernel_time_seconds summary\n"
+        "# HELP gpustress_kernel_time_seconds Device time of sampled kernels.\n";
+    for (const GPUStressTester* tester: testers)
+    {
+        const KernelTimeHistogram& histogram = tester->getKernelTimeHistogram();
+        oss << "gpustress_kernel_time_seconds" << getLabels(tester, "quantile=\"0.5\"") <<
+                " " << (double(histogram.getQuantile(0.5))*1e-9) << "\n"
+            "gpustress_kernel_time_seconds" << getLabels(tester, "quantile=\"0.99\"") <<
+                " " << (double(histogram.getQuantile(0.99))*1e-9) << "\n"
+            "gpustress_kernel_time_seconds" << getLabels(tester, "quantile=\"1\"") <<
+                " " << (double(histogram.getMaxTime())*1e-9) << "\n"
+            "gpustress_kernel_time_seconds_count" << getLabels(tester) << " " <<
+                histogram.getCount() << "\n"
+            "gpustress_kernel_time_seconds_sum" << getLabels(tester) << " " <<
+                (double(histogram.getTimeSum())*1e-9) << "\n";
+    }
+    oss << "# EOF\n";
+    return oss.str();
+}
+
+std::string GPUStressMetricsServer::getLabels(const GPUStressTester* tester,
+                const char* extraLabel)
+{
+    std::string labels = "{device=\"";
+    labels += std::to_string(tester->getId());
+    labels += "\",name=\"";
+    // OpenMetrics label values are escaped like JSON strings
+    labels += escapeJSONString(tester->getPlatformName() + ":" + tester->getDeviceName());
+    labels += "\"";
+    if (extraLabel != nullptr)
+    {
+        labels += ",";
+        labels += extraLabel;
+    }
+    return labels + "}";
+}
+
+std::string GPUStressMetricsServer::getJSONSnapshot() const
+{
+    std::ostringstream oss;
+    oss << "{\"devices\":[";
+    for (size_t i = 0; i < testers.size(); i++)
+    {
+        const GPUStressTester* tester = testers[i];
+        const GPUStressLiveStats stats = tester->getLiveStats();
+        const KernelTimeHistogram& histogram = tester->getKernelTimeHistogram();
+        oss << ((i != 0) ? "," : "") <<
+            "{\"device\":" << tester->getId() <<
+            ",\"platformName\":\"" << escapeJSONString(tester->getPlatformName()) <<
+            "\",\"deviceName\":\"" << escapeJSONString(tester->getDeviceName()) <<
+            "\",\"passes\":" << stats.passesNum <<
+            ",\"failed\":" << (tester->isFailed() ? "true" : "false") <<
+            ",\"bandwidth\":" << stats.bandwidth <<
+            ",\"perf\":" << stats.perf <<
+            ",\"rollingBandwidth\":" << stats.rollingBandwidth <<
+            ",\"rollingPerf\":" << stats.rollingPerf <<
+            ",\"sampledKernels\":" << histogram.getCount() <<
+            ",\"kernelTimeP50\":" << (double(histogram.getQuantile(0.5))*1e-9) <<
+            ",\"kernelTimeP99\":" << (double(histogram.getQuantile(0.99))*1e-9) <<
+            ",\"kernelTimeMax\":" << (double(histogram.getMaxTime())*1e-9) << "}";
+    }
+    oss << "]}\n";
+    return oss.str();
+}
+
+#ifndef _WINDOWS
+static void sendAll(int fd, const std::string& data)
+{
+#ifdef MSG_NOSIGNAL
+    const int sendFlags = MSG_NOSIGNAL;
+#else
+    const int sendFlags = 0;
+#endif
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        const ssize_t ret = ::send(fd, data.data()+sent, data.size()-sent, sendFlags);
+        if (ret <= 0)
+            return; // client closed connection
+        sent += ret;
+    }
+}
+
+void GPUStressMetricsServer::handleClient(int fd)
+{
+    // client can't block server for long time
+    struct timeval timeout = { 1, 0 };
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    std::string request;
+    char buf[1024];
+    while (request.size() < 8192 && request.find("\r\n\r\n") == std::string::npos)
+    {
+        const ssize_t ret = ::recv(fd, buf, 1024, 0);
+        if (ret <= 0)
+            break;
+        request.append(buf, ret);
+    }
+    const size_t lineEnd = request.find("\r\n");
+    const std::string requestLine = request.substr(0, lineEnd);
+    std::string path;
+    if (requestLine.compare(0, 4, "GET ") == 0)
+        path = requestLine.substr(4, requestLine.find(' ', 4)-4);
+    
+    std::string body, status = "200 OK", contentType;
+    if (path == "/metrics")
+    {
+        body = getOpenMetrics();
+        contentType = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+    }
+    else if (path == "/json")
+    {
+        body = getJSONSnapshot();
+        contentType = "application/json";
+    }
+    else
+    {
+        status = "404 Not Found";
+        body = "Not found\n";
+        contentType = "text/plain";
+    }
+    sendAll(fd, "HTTP/1.0 " + status + "\r\nContent-Type: " + contentType +
+            "\r\nContent-Length: " + std::to_string(body.size()) +
+            "\r\nConnection: close\r\n\r\n" + body);
+}
+
+void GPUStressMetricsServer::run()
+{
+    while (!stopRequest.load())
+    {
+        struct pollfd pfd;
+        pfd.fd = listenFd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        // timeout to check stop request
+        if (::poll(&pfd, 1, 200) <= 0)
+            continue;
+        const int clientFd = ::accept(listenFd, nullptr, nullptr);
+        if (clientFd < 0)
+            continue;
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+        // no MSG_NOSIGNAL (MacOS X), disable SIGPIPE for this socket
+        const int noSigPipe = 1;
+        ::setsockopt(clientFd, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+#endif
+        try
+        { handleClient(clientFd); }
+        catch(...)
+        { } // ignore errors of single request
+        ::close(clientFd);
+    }
+}
+#endif
+
+void GPUStressMetricsServer::start(const std::vector<GPUStressTester*>& thisTesters)
+{
+    if (metricsServerPort == 0 && metricsServerSocket == nullptr)
+        return; // disabled
+#ifdef _WINDOWS
+    throw MyException("Metrics server is not supported on Windows");
+#else
+    testers.assign(thisTesters.begin(), thisTesters.end());
+    std::string address;
+    if (metricsServerSocket != nullptr)
+    {
+        struct sockaddr_un addr;
+        ::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (::strlen(metricsServerSocket) >= sizeof(addr.sun_path))
+            throw MyException("Metrics socket path is too long");
+        ::strcpy(addr.sun_path, metricsServerSocket);
+        struct stat st;
+        if (::lstat(metricsServerSocket, &st) == 0)
+        {   // remove only old socket, never other file
+            if (!S_ISSOCK(st.st_mode))
+                throw MyException("Can't bind metrics socket");
+            ::unlink(metricsServerSocket);
+        }
+        listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listenFd < 0)
+            throw MyException("Can't create metrics socket");
+        if (::bind(listenFd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0)
+        {
+            ::close(listenFd);
+            listenFd = -1;
+            throw MyException("Can't bind metrics socket");
+        }
+        address = metricsServerSocket;
+    }
+    else
+    {   /* only local connections */
+        struct sockaddr_in addr;
+        ::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(metricsServerPort);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        listenFd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (listenFd < 0)
+            throw MyException("Can't create metrics socket");
+        const int reuseAddr = 1;
+        ::setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuseAddr, sizeof(reuseAddr));
+        if (::bind(listenFd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0)
+        {
+            ::close(listenFd);
+            listenFd = -1;
+            throw MyException("Can't bind metrics socket");
+        }
+        address = "127.0.0.1:" + std::to_string(metricsServerPort);
+    }
+    if (::listen(listenFd, 8) < 0)
+    {
+        ::close(listenFd);
+        listenFd = -1;
+        throw MyException("Can't listen on metrics socket");
+    }
+    stopRequest.store(false);
+    serverThread = std::thread(&GPUStressMetricsServer::run, this);
+    
+    std::lock_guard<std::mutex> l(stdOutputMutex);
+    *outStream << "Metrics server listens on " << address << std::endl;
+    handleOutput(UINT_MAX);
+#endif
+}
+
+void GPUStressMetricsServer::stop()
+{
+#ifndef _WINDOWS
+    if (listenFd < 0)
+        return;
+    stopRequest.store(true);
+    serverThread.join();
+    ::close(listenFd);
+    listenFd = -1;
+    if (metricsServerSocket != nullptr)
+        ::unlink(metricsServerSocket);
+#endif
 }
@@ -26,10 +26,15 @@
 #include <numeric>
 #include <string>
 #include <vector>
+#include <deque>
 #include <mutex>
+#include <condition_variable>
 #include <random>
 #include <chrono>
 #include <atomic>
+#include <thread>
+#include <functional>
+#include <memory>
 #include <CL/cl.hpp>
 
 #ifdef _WINDOWS
@@ -82,6 +87,84 @@ struct GPUStressConfig
     bool inputAndOutput;
 };
 
+enum VerificationMode
+{
+    VERIFY_HOST_COMPARE = 0,    // read back whole output and compare on host
+    VERIFY_DEVICE_COMPARE,      // compare output with golden results on device
+    VERIFY_DIGEST               // compare digests of workgroups output
+};
+
+enum CalibrationMode
+{
+    CALIBRATE_SWEEP = 0,        // probe all kitersNum from 1 to 40
+    CALIBRATE_SEARCH            // coarse-to-fine search
+};
+
+enum AutotuneObjective
+{
+    AUTOTUNE_PERF = 0,          // maximal GFLOPS
+    AUTOTUNE_BANDWIDTH,         // maximal bandwidth
+    AUTOTUNE_PRODUCT,           // maximal GFLOPS*bandwidth
+    AUTOTUNE_KERNEL_TIME        // longest kernel under time cap
+};
+
+enum TimingEstimator
+{
+    TIMING_MEDIAN = 0,          // median and median absolute deviation
+    TIMING_TRIMMED_MEAN         // mean without 20% lowest and highest samples
+};
+
+enum MetricsFormat
+{
+    METRICS_JSON_LINES = 0,
+    METRICS_CSV
+};
+
+// host stages of single pass
+enum PassStage
+{
+    PASS_STAGE_UPLOAD = 0,  // reset to initial values (device time if profiled)
+    PASS_STAGE_KERNELS,     // enqueueing kernels and waiting for throttled kernels
+    PASS_STAGE_READBACK,    // waiting for results
+    PASS_STAGE_COMPARE,     // verifying results
+    PASS_STAGE_LOGGING,     // printing status
+    PASS_STAGES_NUM
+};
+
+enum MetricsRecordType
+{
+    METRICS_CALIBRATION = 0,
+    METRICS_PASS,
+    METRICS_FAILURE,
+    METRICS_EXIT,
+    METRICS_WARNING
+};
+
+struct MetricsRecord
+{
+    MetricsRecordType type;
+    cxuint id;
+    cxuint passNum;
+    double kernelTime;      // in seconds
+    double bandwidth;       // in GB/s
+    double perf;            // in GFLOPS
+    double elapsedTime;     // in seconds from start of test
+    double verifyLatency;   // in seconds, verification time of pass results
+    double degradedTime;    // in seconds, time of degraded throughput (exit record)
+    double stageTimes[PASS_STAGES_NUM]; // in seconds, for pass (totals in exit record)
+    const char* message;    // fail or warning message or null
+};
+
+// live statistics of tester, readable while test is running
+struct GPUStressLiveStats
+{
+    cxuint passesNum;       // verified passes
+    double bandwidth;       // in GB/s, from last pass
+    double perf;            // in GFLOPS, from last pass
+    double rollingBandwidth;    // moving average
+    double rollingPerf;         // moving average
+};
+
 typedef void (*OutputHandler)(void* data, cxuint id);
 
 extern int useCPUs;
@@ -93,6 +176,39 @@ extern int useIntelPlatform;
 extern bool useAllPlatforms;
 
 extern int exitIfAllFails;
+extern int verificationMode;
+extern int compareThreadsNum;
+extern int pipelineDepth;
+extern int useAsyncEngine;
+extern int useOutOfOrderQueues;
+extern const char* programCacheDir;
+extern int useSharedPrograms;
+extern int calibrationMode;
+extern int calibrationBudget;
+extern int calibrationTolerance;
+extern int autotuneBudget;
+extern int autotuneObjective;
+extern int autotuneTimeCap;
+extern const char* calibrationProfilesFile;
+extern int calibrationRevalidate;
+extern int timingWarmup;
+extern int timingSamples;
+extern int timingEstimator;
+extern int timingConfidence;
+extern int kernelSamplingPeriod;
+extern const char* metricsFile;
+extern int metricsFormat;
+extern int metricsServerPort;
+extern const char* metricsServerSocket;
+extern int driftThreshold;
+extern int driftSigma;
+extern const char* traceFile;
+extern int traceBufferSize;
+extern int useAsyncLogger;
+extern const char* logDirectory;
+extern int maxQueuedTime;
+extern int stopLatency;
+extern int kernelTimeSlice;
 
 extern std::mutex stdOutputMutex;
 extern std::ostream* outStream;
@@ -100,6 +216,15 @@ extern std::ostream* errStream;
 extern std::atomic<bool> stopAllStressTestersIfFail;
 extern std::atomic<bool> stopAllStressTestersByUser;
 
+/* requests stop of all testers and wakes up testers waiting for events,
+ * byUser - stopped by user (otherwise because some device failed) */
+extern void stopAllStressTesters(bool byUser);
+/* only records time of stop request (safe in signal handler), caller sets stop flag
+ * and waiting testers notice it within short time */
+extern void recordStopRequest();
+// clears stop flags and time of stop request before next test
+extern void clearStopRequest();
+
 extern OutputHandler outputHandler;
 extern void* outputHandlerData;
 
@@ -119,9 +244,18 @@ extern std::vector<GPUStressConfig> collectGPUStressConfigs(cxuint devicesNum,
         const std::vector<cxuint>& blocksNumVec, const std::vector<cxuint>& kitersNumVec,
         const std::vector<cxuint>& builtinKernelVec, const std::vector<bool>& inAndOutVec);
 
+extern void checkGPUStressOptions();
+
 extern void installOutputHandler(std::ostream* out, std::ostream* err,
                 OutputHandler handler = nullptr, void* data = nullptr);
 
+/* structured records are written to stream in given format (MetricsFormat),
+ * null stream disables metrics */
+extern void installMetricsSink(std::ostream* stream, int format);
+// opens metricsFile and installs it as metrics sink (if metricsFile is set)
+extern void openMetricsFile();
+extern void emitMetricsRecord(const MetricsRecord& record);
+
 inline void handleOutput(cxuint id)
 {
     if (outputHandler == nullptr)
@@ -129,9 +263,112 @@ inline void handleOutput(cxuint id)
     outputHandler(outputHandlerData, id);
 }
 
+/* writes output of tester: through active asynchronous logger or directly to
+ * output stream (or error stream) */
+extern void logTesterOutput(cxuint id, const std::string& text, bool error = false);
+
+/* histogram of kernel times with logarithmic buckets (8 buckets per power of 2),
+ * single writer, readers can read it concurrently without locks */
+class KernelTimeHistogram
+{
+public:
+    static const cxuint bucketsNum = 64*8;
+private:
+    std::atomic<cl_ulong> buckets[bucketsNum];
+    std::atomic<cl_ulong> count;
+    std::atomic<cl_ulong> timeSum;
+    std::atomic<cl_ulong> maxTime;
+public:
+    KernelTimeHistogram();
+    
+    void record(cl_ulong kernelTime);
+    // returns upper bound of bucket holding given quantile
+    cl_ulong getQuantile(double quantile) const;
+    
+    cl_ulong getCount() const
+    { return count.load(std::memory_order_acquire); }
+    cl_ulong getTimeSum() const
+    { return timeSum.load(std::memory_order_relaxed); }
+    cl_ulong getMaxTime() const
+    { return maxTime.load(std::memory_order_relaxed); }
+};
+
+/* persistent threads running parallel tasks, caller thread runs first task
+ * and every worker runs one next task */
+class WorkerPool
+{
+private:
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::condition_variable doneCond;
+    const std::function<void(size_t)>* task;
+    size_t tasksNum;
+    cxuint generation;
+    size_t pendingWorkers;
+    bool stopRequest;
+    
+    void runWorker(size_t index);
+public:
+    WorkerPool();
+    ~WorkerPool();
+    
+    // creates given number of worker threads (besides caller thread)
+    void start(size_t workersNum);
+    void stop();
+    
+    size_t getThreadsNum() const
+    { return threads.size()+1; }
+    // runs task(i) for i < tasksNum (tasksNum can not be greater than getThreadsNum())
+    void run(size_t tasksNum, const std::function<void(size_t)>& task);
+};
+
+class GPUStressReactor;
+
 class GPUStressTester
 {
 private:
+    enum BufferSetState
+    {
+        BUFSET_IDLE = 0,    // free for next pass
+        BUFSET_UPLOADING,   // resetting to initial values
+        BUFSET_EXECUTING,   // enqueueing kernels
+        BUFSET_READING,     // results are being read back (or compared on device)
+        BUFSET_VERIFYING    // results are checked on host
+    };
+    
+    enum KernelsStatus
+    {
+        KERNELS_ENQUEUED = 0,   // all kernels of pass enqueued
+        KERNELS_THROTTLED,      // must wait for waitLaunchEvent before continuing
+        KERNELS_STOPPED         // stopped by user or by failure
+    };
+    
+    enum AsyncWait
+    {
+        ASYNC_NONE = 0,
+        ASYNC_KERNEL,           // waits for throttling kernel
+        ASYNC_RESULTS           // waits for results of oldest pass
+    };
+    
+    struct BufferSet
+    {
+        BufferSetState state;
+        cxuint passNum;
+        cxuint nextKernel;
+        cl::Buffer buffer1, buffer2;
+        cl::Event resetEvent;
+        std::vector<cl::Event> execEvents;
+        cl::Event readEvent;
+        cl_ulong stageNanos[PASS_STAGES_NUM];
+        
+        std::vector<float> results;
+        cl::Buffer clMismatchBuffer;
+        std::vector<cl_uint> mismatches;
+        cl::Buffer clDigestBuffer;
+        std::vector<cl_ulong> digests;
+    };
+    
     cxuint id;
     cl::Device clDevice;
     cl::Context clContext;
@@ -144,13 +381,105 @@ private:
     
     cxuint stepsPerWait;
     
+    /* in-flight depth controller (if maxQueuedTime is set): inFlightDepth kernels are
+     * enqueued between waits, inFlightSlack kernels stay queued when host wakes up */
+    cxuint inFlightDepth;
+    cxuint inFlightSlack;
+    cxuint gapFreeWaits;
+    double avgKernelTime;
+    /* launches are counted over all buffer sets and passes, so queued work never
+     * exceeds inFlightDepth+inFlightSlack launches */
+    cxuint launchesAfterWait;
+    std::deque<cl::Event> queuedLaunches; // possibly unfinished launches, oldest first
+    cl::Event waitLaunchEvent;  // launch awaited after throttling
+    // first launch of batch before awaited launch and its predecessor (idle gaps)
+    cl::Event batchFirstEvent, batchPrevEvent;
+    
+    /* waiting for events with stop latency limit (stopLatency), event callbacks
+     * hold own reference, because they can be called after destruction of tester */
+    struct WaitState
+    {
+        std::mutex mutex;
+        std::condition_variable cond;
+    };
+    std::shared_ptr<WaitState> waitState;
+    
     rt_time_point startTime;
     std_time_point lastTime;
     
     cl::CommandQueue clCmdQueue1, clCmdQueue2;
+    bool queue1Profiling; // first queue has profiling enabled
+    cl::Event lastKernelEvent; // last kernel of previously enqueued pass
+    
+    // device times of every kernelSamplingPeriod-th kernel
+    KernelTimeHistogram kernelTimes;
+    cxuint kernelsToSample;
+    cl_ulong lastSampledCount, lastSampledTimeSum;
+    
+    cl_ulong calibKernelTime;
+    cxuint lastPassNum; // last verified pass
+    std_time_point lastPassTime;
+    
+    // updated after every pass, read by metrics server
+    std::atomic<cxuint> passesNum;
+    std::atomic<double> passBandwidth, passPerf;
+    std::atomic<double> rollingBandwidth, rollingPerf;
+    
+    // statistics of pass time relative to calibrated kernel time
+    struct DriftDetector
+    {
+        cxuint passesNum = 0;
+        double baseline = 0.0;  // mean ratio from first passes
+        double mean = 0.0;      // exponentially weighted mean of ratio
+        double variance = 0.0;
+        bool degraded = false;
+        cl_ulong degradedNanos = 0;
+    };
+    DriftDetector driftDetector;
+    
+    cl_ulong stageTotalNanos[PASS_STAGES_NUM];
+    cl_ulong stageMaxNanos[PASS_STAGES_NUM];
     
-    cl::Buffer clBuffer1, clBuffer2;
-    cl::Buffer clBuffer3, clBuffer4;
+    enum TraceTrack
+    {
+        TRACE_HOST = 0,
+        TRACE_QUEUE1,
+        TRACE_QUEUE2
+    };
+    struct TraceEvent
+    {
+        const char* name;
+        cxuint track;
+        int64_t start;      // in nanoseconds from start of test
+        int64_t duration;
+    };
+    /* records host span from construction to destruction or finish(),
+     * adds its duration to stageNanos if given */
+    struct TraceSpan
+    {
+        GPUStressTester* tester;
+        const char* name;
+        cl_ulong* stageNanos;
+        int64_t start;
+        TraceSpan(GPUStressTester* tester, const char* name,
+                  cl_ulong* stageNanos = nullptr);
+        ~TraceSpan();
+        void finish();
+    };
+    // ring buffer of trace events
+    std::vector<TraceEvent> traceEvents;
+    size_t traceEventsNum = 0;
+    int64_t traceAlignHostTime = 0; // host time of first queued command
+    int64_t traceDeviceOffset = 0;
+    bool traceDeviceOffsetSet = false;
+    
+    std::vector<BufferSet> bufferSets;
+    cl::Buffer clInitBuffer; // pristine copy of initial values
+    cxuint curSet;
+    cxuint nextPassNum;
+    
+    GPUStressReactor* reactor;
+    AsyncWait asyncWait;
     
     cxuint workFactor;
     cxuint blocksNum;
@@ -160,39 +489,150 @@ private:
     
     size_t bufItemsNum;
     
-    float* initialValues;
     float* toCompare;
-    float* results;
+    WorkerPool comparePool;
+    
+    cl::Program clVerifyProgram;
+    cl::Kernel clCompareKernel;
+    cl::Buffer clGoldenBuffer;
+    
+    cl::Kernel clDigestKernel;
+    size_t digestGroupSize;
+    size_t digestsNum;
+    std::vector<cl_ulong> goldenDigests;
     
     size_t clKernelSourceSize;
     const char* clKernelSource;
+    cxuint builtinKernel;
     
     bool usePolyWalker;
     
+    bool useSharedContext;
+    // releases program from shared programs registry
+    struct SharedProgramRef
+    {
+        std::string key;
+        ~SharedProgramRef();
+        void release();
+    };
+    SharedProgramRef sharedProgramRef;
+    SharedProgramRef verifyProgramRef;
     cl::Program clProgram;
     cl::Kernel clKernel;
     
     size_t groupSize;
     size_t workSize;
+    /* kernel is launched in kernelChunksNum parts (chunkSize work items, global offsets)
+     * to keep every launch under kernelTimeSlice */
+    cxuint kernelChunksNum;
+    size_t chunkSize;
     
-    bool failed;
+    std::atomic<bool> failed;
     std::string failMessage;
     
     bool initialized;
     
-    void printBuildLog();
+    void printBuildLog(const cl::Program& program);
     void printStatus(cxuint passNum);
     void throwFailedComputations(cxuint passNum);
     
+    void createOutOfOrderQueues();
+    void resetBuffer(cl::CommandQueue& cmdQueue, const cl::Buffer& buffer,
+                cl::Event* event = nullptr);
+    
+    bool checkExitRequest();
+    
+    const cl::Buffer& getOutputBuffer(const BufferSet& bufferSet) const
+    { return (!useInputAndOutput || (passItersNum&1) == 0) ?
+                bufferSet.buffer1 : bufferSet.buffer2; }
+    
+    cl::Program buildVerifyProgram();
+    void buildVerifyKernels();
+    void enqueueDigests(cl::CommandQueue& cmdQueue, const cl::Buffer& outBuffer,
+                BufferSet& bufferSet, const std::vector<cl::Event>* waitList,
+                cl::Event* event);
+    void beginBufferSet(BufferSet& bufferSet);
+    KernelsStatus enqueueKernels(BufferSet& bufferSet);
+    void checkKernelEvent(const cl::Event& event);
+    // adjusts inFlightDepth and inFlightSlack after wait for waitLaunchEvent
+    void updateInFlightDepth();
+    bool executeBufferSet(BufferSet& bufferSet);
+    void enqueueResultsCheck(BufferSet& bufferSet);
+    void checkResults(BufferSet& bufferSet);
+    
+    void prepareTest();
+    bool finishQueues();
+    void finishTest();
+    void reportFailure();
+    
+    void updateDriftDetector(cxuint passNum, cl_ulong passNanos);
+    void reportDrift(cxuint passNum, const char* message);
+    
+    void addTraceEvent(const char* name, cxuint track, int64_t start, int64_t duration);
+    void traceDeviceEvent(const char* name, cxuint track, const cl::Event& event);
+    
+    MetricsRecord makeMetricsRecord(MetricsRecordType type) const;
+    void printStageSummary();
+    void emitExitRecord();
+    
+    static void CL_CALLBACK waitEventCallback(cl_event event, cl_int status, void* data);
+    // returns false if stop has been requested before completion of event
+    bool waitForEvent(const cl::Event& event);
+    void reportStopLatency();
+    
+    static void CL_CALLBACK asyncEventCallback(cl_event event, cl_int status, void* data);
+    bool stepAsync();
+    
+    std::string getProgramCacheKey(const char* buildOptions) const;
+    std::string getProgramCachePath(const std::string& cacheKey) const;
+    bool loadCachedProgram(const char* buildOptions, cl::Program& program);
+    void storeCachedProgram(const cl::Program& program, const char* buildOptions);
+    cl::Program buildProgram(const char* buildOptions);
+    /* returns program from registry of shared programs (keyed by context, source
+     * and build options), first tester builds it by calling build */
+    cl::Program acquireSharedProgram(const char* source, const char* buildOptions,
+                SharedProgramRef& programRef, const std::function<cl::Program()>& build);
+    
     void buildKernel(cxuint kitersNum, cxuint blocksNum, bool alwaysPrintBuildLog,
-         bool whenCalibrates);
+         bool whenCalibrates, bool runtimeIters = false);
+    // maxSamplesNum - zero if timingSamples
+    bool measureKernelTime(cl::CommandQueue& profCmdQueue, cl_ulong& kernelTime,
+                double& noise, cxuint maxSamplesNum = 0);
+    void setKernelArgs(const cl::Buffer& buffer1, const cl::Buffer& buffer2);
+    void enqueueKernelChunk(cl::CommandQueue& cmdQueue, cxuint chunk,
+                const std::vector<cl::Event>* waitList, cl::Event* event);
+    // chooses kernelChunksNum, so every launch of kernel takes at most kernelTimeSlice
+    void splitKernel(cl_ulong kernelTime);
+    // chooses kernelChunksNum for calibrated kernel time and measures chunked kernel
+    bool setupKernelChunks(cl::CommandQueue& profCmdQueue, cl_ulong kernelTime);
+    
+    // stored result of calibration
+    struct CalibrationProfile
+    {
+        cxuint kitersNum;
+        cl_ulong kernelTime;
+        double bandwidth;
+        double perf;
+    };
+    std::string getCalibrationProfileKey() const;
+    bool loadCalibrationProfile(const std::string& key, CalibrationProfile& profile);
+    void storeCalibrationProfile(const std::string& key, const CalibrationProfile& profile);
     void calibrateKernel();
 public:
-    GPUStressTester(cxuint id, cl::Device& clDevice, const GPUStressConfig& config);
+    GPUStressTester(cxuint id, cl::Device& clDevice, const GPUStressConfig& config,
+                const cl::Context* sharedContext = nullptr);
     ~GPUStressTester();
     
     void runTest();
     
+    /* asynchronous execution driven by GPUStressReactor,
+     * returns false if tester finished */
+    bool startAsync(GPUStressReactor* reactor);
+    bool resumeAsync();
+    
+    // wakes up tester waiting for event (after stop request)
+    void wakeUp();
+    
     bool isInitialized() const
     { return initialized; }
     
@@ -200,6 +640,114 @@ public:
     { return failed; }
     const std::string& getFailMessage() const
     { return failMessage; }
+    
+    const KernelTimeHistogram& getKernelTimeHistogram() const
+    { return kernelTimes; }
+    
+    cxuint getId() const
+    { return id; }
+    const std::string& getPlatformName() const
+    { return platformName; }
+    const std::string& getDeviceName() const
+    { return deviceName; }
+    GPUStressLiveStats getLiveStats() const;
+    
+    // writes trace events in Chrome trace event format (without enclosing array)
+    void writeTraceEvents(std::ostream& os, bool& first) const;
+};
+
+// writes trace events of testers to traceFile (if set)
+extern void writeTraceFile(const std::vector<GPUStressTester*>& testers);
+
+/* searches groupSize, workFactor, blocksNum and kitersNum for device */
+extern GPUStressConfig autotuneGPUStressConfig(cxuint id, cl::Device& clDevice,
+        const GPUStressConfig& config);
+
+/* creates testers for all devices concurrently,
+ * returns empty vector if initialization has been stopped by user */
+extern std::vector<GPUStressTester*> createGPUStressTesters(
+        std::vector<cl::Device>& clDevices, const std::vector<GPUStressConfig>& configs);
+
+/* drives all testers in single thread, waking up on event callbacks */
+class GPUStressReactor
+{
+private:
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<GPUStressTester*> readyTesters;
+    bool stopRequested = false;
+public:
+    void notify(GPUStressTester* tester);
+    // wakes up reactor after stop request (testers are resumed without their events)
+    void wakeUp();
+    void run(const std::vector<GPUStressTester*>& testers);
+};
+
+/* HTTP server with OpenMetrics (/metrics) and JSON (/json) snapshot of testers,
+ * listens on localhost port (metricsServerPort) or Unix socket (metricsServerSocket) */
+class GPUStressMetricsServer
+{
+private:
+    int listenFd;
+    std::atomic<bool> stopRequest;
+    std::thread serverThread;
+    std::vector<const GPUStressTester*> testers;
+    
+    static std::string getLabels(const GPUStressTester* tester,
+                const char* extraLabel = nullptr);
+    std::string getOpenMetrics() const;
+    std::string getJSONSnapshot() const;
+    void handleClient(int fd);
+    void run();
+public:
+    GPUStressMetricsServer();
+    ~GPUStressMetricsServer();
+    
+    // does nothing if server is not enabled
+    void start(const std::vector<GPUStressTester*>& testers);
+    void stop();
+};
+
+/* asynchronous logger: every tester puts its output into own lock-free ring,
+ * background thread writes it in batches to output streams and to log files
+ * (logDirectory/gpustress-ID.log) with timestamps */
+class GPUStressLogger
+{
+private:
+    struct LogEntry
+    {
+        RealtimeClock::time_point time;
+        bool error;
+        cxuint length;
+        char text[240];
+    };
+    // single producer (tester) and single consumer (writer thread)
+    struct Ring
+    {
+        std::vector<LogEntry> entries;
+        std::atomic<size_t> head;
+        std::atomic<size_t> tail;
+        bool lineStart; // used only by writer thread
+    };
+    
+    std::vector<Ring> rings;
+    std::vector<std::ostream*> logFiles;
+    std::thread writerThread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool stopRequest;
+    
+    bool drain();
+    void run();
+public:
+    GPUStressLogger();
+    ~GPUStressLogger();
+    
+    // does nothing if asynchronous logging and log directory are not enabled
+    void start(const std::vector<GPUStressTester*>& testers);
+    void stop();
+    // returns false if tester has no ring (then caller should write output directly)
+    bool write(cxuint id, const std::string& text, bool error);
 };
 
 #endif
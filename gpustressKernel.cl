@@ -76,6 +76,6 @@ kernel void gpuStress(uint n, const global float4* input, global float4* output)
         output[gid*4+2] = inValue3;
         output[gid*4+3] = inValue4;
         
-        gid += get_global_size(0);
+        gid += n;
     }
 }
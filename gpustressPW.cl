@@ -48,6 +48,6 @@ kernel void gpuStress(uint n, const global float4* input,
         output[gid*4+2] = x3;
         output[gid*4+3] = x4;
         
-        gid += get_global_size(0);
+        gid += n;
     }
 }